@@ -0,0 +1,212 @@
+/*
+ * SSD1963 Framebuffer - userspace interface
+ *
+ * ioctl definitions for the /proc/udas_fb entries (udas_fb for the first
+ * panel, udas_fb1, udas_fb2... for the others). This header is shared by the
+ * driver and by userspace applications.
+ *
+ */
+
+#ifndef SSD1963_IOCTL_H
+#define SSD1963_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define SSD1963_IOC_MAGIC	'S'
+
+// Image IDs below this value are reserved for the images built into the driver
+// (the same values accepted by the "image" module parameter)
+#define SSD1963_CACHE_ID_USER_MIN	16
+
+// Upload an RGB565 (little endian) image into the kernel image cache
+struct ssd1963_cache_upload {
+	__u32	id;
+	__u16	width;
+	__u16	height;
+	__u64	data;		// user pointer to width * height * 2 bytes
+};
+
+// Display a cached image with its top left corner at (col, row)
+struct ssd1963_cache_show {
+	__u32	id;
+	__s16	col;
+	__s16	row;
+};
+
+#define SSD1963_IOC_CACHE_UPLOAD	_IOW(SSD1963_IOC_MAGIC, 0x01, struct ssd1963_cache_upload)
+#define SSD1963_IOC_CACHE_SHOW		_IOW(SSD1963_IOC_MAGIC, 0x02, struct ssd1963_cache_show)
+#define SSD1963_IOC_CACHE_DROP		_IOW(SSD1963_IOC_MAGIC, 0x03, __u32)
+
+#define SSD1963_SPRITE_MAX		8	// sprite IDs are 0 to SSD1963_SPRITE_MAX - 1
+#define SSD1963_SPRITE_MAX_DIM	64	// maximum sprite width and height
+
+// Register (or replace) an RGB565 (little endian) sprite, pixels equal to
+// colorkey are transparent. New sprites start hidden.
+struct ssd1963_sprite_register {
+	__u32	id;
+	__u16	width;
+	__u16	height;
+	__u16	colorkey;
+	__u16	reserved;
+	__u64	data;		// user pointer to width * height * 2 bytes
+};
+
+// Position a sprite with its top left corner at (col, row) and show or hide it
+struct ssd1963_sprite_move {
+	__u32	id;
+	__s16	col;
+	__s16	row;
+	__u32	visible;
+};
+
+#define SSD1963_IOC_SPRITE_REGISTER	_IOW(SSD1963_IOC_MAGIC, 0x10, struct ssd1963_sprite_register)
+#define SSD1963_IOC_SPRITE_MOVE		_IOW(SSD1963_IOC_MAGIC, 0x11, struct ssd1963_sprite_move)
+
+// Display a rectangle of the full-screen RGB565 (little endian) frame held in
+// the /proc/udas_fb buffer, with a stride of one panel row. Rectangles
+// submitted before the driver picks them up are merged into their union.
+struct ssd1963_submit {
+	__s16	col;
+	__s16	row;
+	__u16	width;
+	__u16	height;
+};
+
+// Priority classes of submitted rectangles, drawn most urgent first. Low
+// priority rectangles are drawn in bands of rows (the chunkRows module
+// parameter) and yield to the other classes between bands.
+#define SSD1963_PRIO_HIGH		0	// alarms, safety indicators
+#define SSD1963_PRIO_NORMAL		1	// SSD1963_IOC_SUBMIT
+#define SSD1963_PRIO_LOW		2	// background redraws
+#define SSD1963_PRIO_COUNT		3
+
+// SSD1963_IOC_SUBMIT with a priority class, rectangles are merged per class
+struct ssd1963_submit_prio {
+	struct ssd1963_submit rect;
+	__u32	priority;
+};
+
+#define SSD1963_IOC_SUBMIT			_IOW(SSD1963_IOC_MAGIC, 0x20, struct ssd1963_submit)
+// Wait until every request submitted before the call is on the glass, the
+// argument is a timeout in ms
+#define SSD1963_IOC_WAIT			_IOW(SSD1963_IOC_MAGIC, 0x21, __u32)
+#define SSD1963_IOC_SUBMIT_PRIO		_IOW(SSD1963_IOC_MAGIC, 0x22, struct ssd1963_submit_prio)
+
+#define SSD1963_STREAM_MAX_BUFS	8
+
+// Streaming window at (col, row), entirely on the panel. While configured,
+// every write() to the proc entry is one RGB565 (little endian) frame of
+// width * height pixels, queued in a ring of nbufs (2 to SSD1963_STREAM_MAX_BUFS)
+// slots. The window stays programmed between frames and only the newest
+// queued frame is drawn, the stale ones are dropped. nbufs 0 stops the
+// stream, closing the file that configured it does too.
+struct ssd1963_stream {
+	__s16	col;
+	__s16	row;
+	__u16	width;
+	__u16	height;
+	__u32	nbufs;
+};
+
+#define SSD1963_IOC_STREAM			_IOW(SSD1963_IOC_MAGIC, 0x30, struct ssd1963_stream)
+
+// Pixel format of the /proc/udas_fb buffer. In SSD1963_FORMAT_INDEXED8 a pixel
+// is one byte, an index into the palette, and the frame has a stride of one
+// panel row of bytes; SSD1963_IOC_SUBMIT and the image parameter 2 rectangle
+// take indexed pixels. Stream frames, cached images and sprites stay RGB565.
+#define SSD1963_FORMAT_RGB565		0
+#define SSD1963_FORMAT_INDEXED8		1
+
+#define SSD1963_PALETTE_SIZE		256
+
+// Replace count palette entries starting at first. In indexed mode the pixels
+// using a changed entry are drawn again from the driver's copy of the frame.
+struct ssd1963_palette {
+	__u16	first;
+	__u16	count;		// first + count <= SSD1963_PALETTE_SIZE
+	__u32	reserved;
+	__u64	data;		// user pointer to count RGB565 entries
+};
+
+#define SSD1963_IOC_FORMAT			_IOW(SSD1963_IOC_MAGIC, 0x40, __u32)
+#define SSD1963_IOC_PALETTE			_IOW(SSD1963_IOC_MAGIC, 0x41, struct ssd1963_palette)
+
+// Compressed RGB565 rectangle, entirely on the panel. Passed to
+// SSD1963_IOC_COMPRESSED with data pointing at the compressed bytes, or
+// written to the proc entry with the compressed bytes following the header
+// once SSD1963_IOC_WRITE_MODE selected SSD1963_WRITE_COMPRESSED for that file.
+// Rectangles are drawn in the order they were queued, after the submitted
+// ones.
+#define SSD1963_COMPRESS_MAGIC		0x315a4455	// "UDZ1"
+
+#define SSD1963_COMPRESS_RLE		1	// runs of __le16 count (> 0), __le16 pixel
+#define SSD1963_COMPRESS_LZ4		2	// LZ4 block of width * height * 2 bytes
+
+struct ssd1963_compressed {
+	__u32	magic;		// SSD1963_COMPRESS_MAGIC, write() only
+	__u16	method;
+	__u16	reserved;
+	__s16	col;
+	__s16	row;
+	__u16	width;
+	__u16	height;
+	__u32	length;		// compressed bytes
+	__u32	reserved2;
+	__u64	data;		// SSD1963_IOC_COMPRESSED only, user pointer to length bytes
+};
+
+#define SSD1963_IOC_COMPRESSED		_IOW(SSD1963_IOC_MAGIC, 0x50, struct ssd1963_compressed)
+
+// What write() on an open file takes, per file. Files start in
+// SSD1963_WRITE_PIXELS, so pixel writes are never taken for a header.
+#define SSD1963_WRITE_PIXELS		0	// frame buffer bytes (or stream frames)
+#define SSD1963_WRITE_COMPRESSED	1	// struct ssd1963_compressed, then length bytes
+
+#define SSD1963_IOC_WRITE_MODE		_IOW(SSD1963_IOC_MAGIC, 0x51, __u32)
+
+// Resolution of the panel behind this entry, from its device tree node. The
+// frame buffer (mmap, write() at offset 0) is width * height RGB565 pixels.
+struct ssd1963_geometry {
+	__u16	width;
+	__u16	height;
+	__u32	reserved;
+};
+
+#define SSD1963_IOC_GEOMETRY		_IOR(SSD1963_IOC_MAGIC, 0x52, struct ssd1963_geometry)
+
+// Capture log, read from debugfs ssd1963/capture while the capture module
+// parameter is set (1: rectangles and hashes, 2: with pixel payload). Each
+// record is followed by length bytes of RGB565 (little endian) payload,
+// compressed bytes for SSD1963_CAPTURE_COMPRESSED.
+#define SSD1963_CAPTURE_MAGIC		0x31434455	// "UDC1"
+
+#define SSD1963_CAPTURE_SUBMIT		1	// SSD1963_IOC_SUBMIT(_PRIO), payload is the rectangle,
+										// arg is the priority class
+#define SSD1963_CAPTURE_PACKED		2	// image module parameter 2, packed rectangle
+#define SSD1963_CAPTURE_IMAGE		3	// image module parameter, id
+#define SSD1963_CAPTURE_UPLOAD		4	// SSD1963_IOC_CACHE_UPLOAD
+#define SSD1963_CAPTURE_SHOW		5	// SSD1963_IOC_CACHE_SHOW
+#define SSD1963_CAPTURE_SPRITE		6	// SSD1963_IOC_SPRITE_REGISTER, arg is the colour key
+#define SSD1963_CAPTURE_MOVE		7	// SSD1963_IOC_SPRITE_MOVE, arg is visible
+#define SSD1963_CAPTURE_STREAM		8	// stream frame, payload is the frame, arg is nbufs
+#define SSD1963_CAPTURE_COMPRESSED	9	// SSD1963_IOC_COMPRESSED or compressed write(),
+										// payload and hash are the compressed bytes,
+										// arg is the method
+
+struct ssd1963_capture_record {
+	__u32	magic;
+	__u16	type;
+	__u16	panel;			// index of the proc entry, 0 for /proc/udas_fb
+	__u64	timestamp_ns;	// CLOCK_MONOTONIC
+	__s16	col;
+	__s16	row;
+	__u16	width;
+	__u16	height;
+	__u32	id;
+	__u32	arg;
+	__u32	hash;			// crc32 of the pixels, 0 if the request has none
+	__u32	length;			// payload bytes following the record
+};
+
+#endif /* SSD1963_IOCTL_H */
@@ -0,0 +1,115 @@
+/*
+ * SSD1963 Framebuffer - tracepoints
+ *
+ * Stages of the update pipeline, from the request entering the driver to the
+ * last pixel on the bus:
+ *   ssd1963_user_copy    write() copy into the frame buffer
+ *   ssd1963_submit       request queued for the update worker
+ *   ssd1963_dequeue      request picked up by the update worker
+ *   ssd1963_window       address window opened (0x2A/0x2B/0x2C)
+ *   ssd1963_xfer_start   first pixel of a window
+ *   ssd1963_xfer_end     last pixel of a window
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ssd1963
+
+#if !defined(_SSD1963_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SSD1963_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(ssd1963_user_copy,
+	TP_PROTO(size_t bytes, u64 ns),
+	TP_ARGS(bytes, ns),
+	TP_STRUCT__entry(
+		__field(size_t, bytes)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->bytes = bytes;
+		__entry->ns = ns;
+	),
+	TP_printk("bytes=%zu ns=%llu", __entry->bytes, __entry->ns)
+);
+
+DECLARE_EVENT_CLASS(ssd1963_request,
+	TP_PROTO(const char *source, int col, int row, int width, int height),
+	TP_ARGS(source, col, row, width, height),
+	TP_STRUCT__entry(
+		__string(source, source)
+		__field(int, col)
+		__field(int, row)
+		__field(int, width)
+		__field(int, height)
+	),
+	TP_fast_assign(
+		__assign_str(source, source);
+		__entry->col = col;
+		__entry->row = row;
+		__entry->width = width;
+		__entry->height = height;
+	),
+	TP_printk("%s %dx%d+%d+%d", __get_str(source),
+		  __entry->width, __entry->height, __entry->col, __entry->row)
+);
+
+DEFINE_EVENT(ssd1963_request, ssd1963_submit,
+	TP_PROTO(const char *source, int col, int row, int width, int height),
+	TP_ARGS(source, col, row, width, height)
+);
+
+DEFINE_EVENT(ssd1963_request, ssd1963_dequeue,
+	TP_PROTO(const char *source, int col, int row, int width, int height),
+	TP_ARGS(source, col, row, width, height)
+);
+
+TRACE_EVENT(ssd1963_window,
+	TP_PROTO(int start_col, int end_col, int start_row, int end_row),
+	TP_ARGS(start_col, end_col, start_row, end_row),
+	TP_STRUCT__entry(
+		__field(int, start_col)
+		__field(int, end_col)
+		__field(int, start_row)
+		__field(int, end_row)
+	),
+	TP_fast_assign(
+		__entry->start_col = start_col;
+		__entry->end_col = end_col;
+		__entry->start_row = start_row;
+		__entry->end_row = end_row;
+	),
+	TP_printk("cols=%d-%d rows=%d-%d", __entry->start_col, __entry->end_col,
+		  __entry->start_row, __entry->end_row)
+);
+
+DECLARE_EVENT_CLASS(ssd1963_xfer,
+	TP_PROTO(int pixels),
+	TP_ARGS(pixels),
+	TP_STRUCT__entry(
+		__field(int, pixels)
+	),
+	TP_fast_assign(
+		__entry->pixels = pixels;
+	),
+	TP_printk("pixels=%d", __entry->pixels)
+);
+
+DEFINE_EVENT(ssd1963_xfer, ssd1963_xfer_start,
+	TP_PROTO(int pixels),
+	TP_ARGS(pixels)
+);
+
+DEFINE_EVENT(ssd1963_xfer, ssd1963_xfer_end,
+	TP_PROTO(int pixels),
+	TP_ARGS(pixels)
+);
+
+#endif /* _SSD1963_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ssd1963_trace
+#include <trace/define_trace.h>
@@ -18,10 +18,28 @@
 #include <linux/workqueue.h>
 #include <linux/io.h>
 #include <asm-generic/io.h>
-#include <asm-generic/gpio.h>
 #include <linux/gpio/consumer.h>
 #include <linux/tty.h>
 #include <linux/err.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/of.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/kfifo.h>
+#include <linux/crc32.h>
+#include <linux/seqlock.h>
+#include <video/display_timing.h>
+#include <video/of_display_timing.h>
+
+#include "ssd1963_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "ssd1963_trace.h"
 
 #include "test_image.h"
 #include "test_image2.h"
@@ -37,24 +55,75 @@
 #include <linux/proc_fs.h>
 #include <linux/uaccess.h> /* copy_from_user, copy_to_user */
 #include <linux/slab.h>
+#include <linux/idr.h>
+#include <linux/lz4.h>
+#include <linux/completion.h>
+#include <linux/version.h>
 
-char * framebuffer = NULL;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 17, 0)
+#define pde_data(inode)     PDE_DATA(inode)
+#endif
 
-static int fbinit(void);
-static void fbexit(void);
+struct mmap_info {
+    char *data;
+    int order;      //allocation order of data
+};
 //########################################################
 
+// Panel geometry and timing, from the "panel-timing" device tree node when
+// present. The defaults are the OSD043T3491-19 values (480x272).
+struct disp_panel {
+	int		col_max;		// HDP, last column
+	int		row_max;		// VDP, last row
+	u32		ht;				// horizontal total period
+	u32		hps;			// HSYNC pulse width + horizontal back porch
+	u32		hpw;			// HSYNC pulse width
+	u32		lps;			// horizontal front porch
+	u32		vt;				// vertical total period
+	u32		vps;			// VSYNC pulse width + vertical back porch
+	u32		vpw;			// VSYNC pulse width
+	u32		fps;			// vertical front porch
+	u32		xtal_hz;		// reference clock
+	u32		pll_hz;			// system clock
+	u32		pclk_hz;		// pixel clock
+	u32		pll_m;			// PLL multiplier and divider, see DispPllSolve()
+	u32		pll_n;
+};
+
+static const struct disp_panel disp_panel_default = {
+	.col_max	= 479,
+	.row_max	= 271,
+	.ht			= 525,
+	.hps		= 43,
+	.hpw		= 41,
+	.lps		= 2,
+	.vt			= 286,
+	.vps		= 12,
+	.vpw		= 10,
+	.fps		= 2,
+	.xtal_hz	= 10000000,
+	.pll_hz		= 120000000,
+	.pclk_hz	= 15000000,
+};
+
+// The clipping bounds read the precomputed limits of the panel being drawn
+// (the lcd argument of the render functions), so the render loops cost the
+// same as with the old compile-time constants
 #define DISP_COL_MIN	0
-#define DISP_COL_MAX	479
+#define DISP_COL_MAX	(lcd->panel.col_max)
 
 #define DISP_ROW_MIN	0
-#define DISP_ROW_MAX	271
+#define DISP_ROW_MAX	(lcd->panel.row_max)
 
 #define DISP_RES_HOR	(DISP_COL_MAX + 1)
 #define DISP_RES_VER	(DISP_ROW_MAX + 1)
 
 #define DISP_PIX_TOT	(DISP_RES_HOR * DISP_RES_VER)
 
+// Resolution of the images built into the driver
+#define IMG_RES_HOR		480
+#define IMG_RES_VER		272
+
 #define DISP_BLK		0x0000
 
 #define DISP_RED_MIN	0x0800
@@ -88,62 +157,58 @@ static void fbexit(void);
 #define DISP_RENDER_RESULT_PART	1
 #define DISP_RENDER_RESULT_NONE	2
 
-#define LCD_PWR_EN      116 //on the schematic as BOOT_R
-
-#define LCD_RS          112
-#define LCD_WRn         113
-#define LCD_RDn         114
-#define LCD_D00         96
-#define LCD_D01         97
-#define LCD_D02         98
-#define LCD_D03         99
-#define LCD_D04         100
-#define LCD_D05         101
-#define LCD_D06         102
-#define LCD_D07         103
-#define LCD_D08         104
-#define LCD_D09         105
-#define LCD_D10         106
-#define LCD_D11         107
-#define LCD_D12         108
-#define LCD_D13         109
-#define LCD_D14         110
-#define LCD_D15         111
-#define LCD_CSn         115
-#define LCD_RSTn_R      83
-#define LCD_TE_R        85
-#define LCD_DISP_ON_R   84
-
-#define PWR_ENA()   (__gpio_set_value(LCD_PWR_EN, 0))
-#define PWN_DIS()   (__gpio_set_value(LCD_PWR_EN, 1))
-
-#define RST_ENA()	(__gpio_set_value(LCD_RSTn_R, 0))
-#define RST_DIS()	(__gpio_set_value(LCD_RSTn_R, 1))
-
-#define DISP_DIS()	(__gpio_set_value(LCD_DISP_ON_R, 0))
-#define DISP_ENA()	(__gpio_set_value(LCD_DISP_ON_R, 1))
+// Raw line access, through the _cansleep accessors when a line sits on a
+// sleeping chip (I2C expanders, gpio-sim), see DispGpioGet()
+#define GPIO_WRITE(desc, v) (lcd->gpio_cansleep ? gpiod_set_raw_value_cansleep(desc, v) : \
+                                                  gpiod_set_raw_value(desc, v))
+#define GPIO_READ(desc)     (lcd->gpio_cansleep ? gpiod_get_raw_value_cansleep(desc) : \
+                                                  gpiod_get_raw_value(desc))
+
+// Every gpiolib call of the bus path is counted in stats.gpio_calls
+#define GPIO_SET(desc, v)   (lcd->stats.gpio_calls++, GPIO_WRITE(desc, v))
+#define GPIO_GET(desc)      (lcd->stats.gpio_calls++, GPIO_READ(desc))
+
+// Control lines, from the lcd-*-gpios properties of the device tree node. The
+// levels are raw: /RST, /CS, /WR, /RD and the power enable are active low.
+#define PWR_ENA()   (GPIO_SET(lcd->gpio_pwr, 0))
+#define PWN_DIS()   (GPIO_SET(lcd->gpio_pwr, 1))
+
+#define RST_ENA()	(GPIO_SET(lcd->gpio_rst, 0))
+#define RST_DIS()	(GPIO_SET(lcd->gpio_rst, 1))
+
+#define DISP_DIS()	(GPIO_SET(lcd->gpio_disp, 0))
+#define DISP_ENA()	(GPIO_SET(lcd->gpio_disp, 1))
 
 //#define BL_DIS()	(__gpio_set_value())
 //#define BL_ENA()	(__gpio_set_value())
 //#define BL_TOG()	(__gpio_set_value())
 
-#define CS_ENA()	(__gpio_set_value(LCD_CSn, 0))
-#define CS_DIS()	(__gpio_set_value(LCD_CSn, 1))
+#define CS_ENA()	(GPIO_SET(lcd->gpio_cs, 0))
+#define CS_DIS()	(GPIO_SET(lcd->gpio_cs, 1))
+
+#define CMD_ENA()	(GPIO_SET(lcd->gpio_rs, 0))
+#define DATA_ENA()	(GPIO_SET(lcd->gpio_rs, 1))
 
-#define CMD_ENA()	(__gpio_set_value(LCD_RS, 0))
-#define DATA_ENA()	(__gpio_set_value(LCD_RS, 1))
+#define WR_ENA()	(GPIO_SET(lcd->gpio_wr, 0))
+#define WR_DIS()	(GPIO_SET(lcd->gpio_wr, 1))
 
-#define WR_ENA()	(__gpio_set_value(LCD_WRn, 0))
-#define WR_DIS()	(__gpio_set_value(LCD_WRn, 1))
+#define RD_ENA()	(GPIO_SET(lcd->gpio_rd, 0))
+#define RD_DIS()	(GPIO_SET(lcd->gpio_rd, 1))
 
-#define RD_ENA()	(__gpio_set_value(LCD_RDn, 0))
-#define RD_DIS()	(__gpio_set_value(LCD_RDn, 1))
+#define LCD_DATA_PINS	16		// DB[15:0], lcd-pin-data-gpios in bit order
 
 //module parameters
+static bool p_fastBoot = true;
+module_param_named(fastBoot, p_fastBoot, bool, 0444);
+static bool p_busMock = false;
+module_param_named(busMock, p_busMock, bool, 0644);
+static bool p_busTune = true;       //time the bus backends at probe, see sysfs bus_backend
+module_param_named(busTune, p_busTune, bool, 0444);
 static int p_updates = 0;
 module_param_named(updates, p_updates, int, 0664);
 static int p_state = 0;
 module_param_named(state, p_state, int, 0444);
+// The image parameters drive the first panel (udas_fb) only
 static int p_img = 0;
 module_param_named(image, p_img, int, 0664);
 static int p_col = 0;
@@ -157,74 +222,397 @@ module_param_named(height, p_height, int, 0664);
 static int p_arraySize = 0;
 module_param_named(arraySize, p_arraySize, int, 0664);
 
-// These static vars are initialized in DispInit()
-static unsigned int	CurBackColor;
-static unsigned int	CurForeColor;
-static int		    CurFontType;
-static sFONT	    CurFontStruct;
+//image cache budget in KiB, least recently used images are evicted to stay below it
+static int p_cacheBudget = 2048;
+module_param_named(cacheBudget, p_cacheBudget, int, 0664);
+
+// Rows of a low priority rectangle drawn before more urgent requests are
+// looked at again
+static int p_chunkRows = 16;
+module_param_named(chunkRows, p_chunkRows, int, 0664);
+
+// Threads preparing stripes of large rectangles (format conversion, diffing
+// against the shadow buffer) while the update worker drives the bus, 0 keeps
+// the whole transfer on the update worker
+static int p_prepThreads = 2;
+module_param_named(prepThreads, p_prepThreads, int, 0444);
+
+// Bus backends, see bus_backends
+#define BUS_BACKEND_ORIG    0
+#define BUS_BACKEND_ARRAY   1
+#define BUS_BACKEND_WRITEL  2
+#define BUS_BACKEND_POINTER 3
+#define BUS_BACKEND_MOCK    4
+#define BUS_BACKEND_COUNT   5
+
+// Display pipeline statistics, exposed in debugfs (ssd1963/panel<n>/)
+#define STATS_HIST_BUCKETS  20      //log2 of the transfer time in us, last bucket is open ended
+
+struct ssd1963_stats {
+    u64 updates;                    //worker runs that pushed pixels
+    u64 pixels;
+    u64 bus_words;                  //command and data strobes
+    u64 gpio_calls;                 //gpiolib calls of the bus path
+    u64 windows;                    //column/row address windows opened
+    u64 merged;                     //requests replaced by a newer one before they were drawn
+    u64 dropped;                    //requests that were never drawn
+    u64 preempted;                  //low priority rectangles interrupted by a more urgent one
+    u64 prep_stalls;                //stripes the bus had to wait for
+    u64 prep_skipped;               //stripes equal to the glass, not sent
+    u64 prep_skipped_pixels;        //their pixels, not counted in pixels
+    u64 streamed;                   //stream frames drawn
+    u64 xfer_ns;
+    u64 hist[STATS_HIST_BUCKETS];
+    u64 backend_pixels[BUS_BACKEND_COUNT];      //per bus backend, see bus_backends
+    u64 backend_ns[BUS_BACKEND_COUNT];
+};
+
+static struct dentry *debugfs_root;
+
+//update stream capture: 0 off, 1 rectangles and hashes, 2 with pixel payload
+static int p_capture = 0;
+module_param_named(capture, p_capture, int, 0664);
+static int p_captureBuffer = 4096;      //KiB, allocated on first capture
+module_param_named(captureBuffer, p_captureBuffer, int, 0444);
+
+// State of the in-memory bus model, see BusModelCmd()
+struct bus_model {
+    u8 cmd;                 //last command
+    int param;              //index of the next parameter of cmd
+    int sc, ec, sr, er;     //address window
+    int col, row;           //memory write position
+    u16 *mem;               //DISP_RES_HOR * DISP_RES_VER pixels
+};
+
+struct sprite {
+    bool used;
+    bool visible;
+    bool dirty;             //state changed or background redrawn under it
+    int width;
+    int height;
+    u16 colorkey;
+    u16 *pixels;
+    int col;                //requested position
+    int row;
+    bool drawn;             //what is currently on the glass
+    int drawnCol;
+    int drawnRow;
+    int drawnWidth;
+    int drawnHeight;
+};
+
+// Stripe of a rectangle prepared by the prep workqueue, see FramePrepCopy()
+#define PREP_STRIPES        8
+#define PREP_STRIPE_ROWS    8       //minimum rows of a stripe
+
+struct prep_stripe {
+    struct work_struct work;
+    struct completion done;
+    struct ssd1963 *lcd;
+    int startX, endX, startY, endY;
+    u16 *words;                     //bus words of the stripe
+    bool changed;                   //differs from the shadow buffer
+};
+
+// States of the stream ring slots
+#define STREAM_FREE     0
+#define STREAM_FILLING  1       //write() copying into it
+#define STREAM_QUEUED   2
+#define STREAM_SENDING  3       //update worker drawing it
+
+// One panel. Every panel has its own proc entry, frame buffer and update
+// worker, so several panels are driven concurrently.
+struct ssd1963 {
+	struct device *dev;
+	int index;						// proc entry udas_fb (0) or udas_fb<index>
+	char name[16];
+	struct disp_panel panel;
+
+	struct gpio_desc *gpio_rs;
+	struct gpio_desc *gpio_wr;
+	struct gpio_desc *gpio_rd;
+	struct gpio_desc *gpio_cs;
+	struct gpio_desc *gpio_rst;
+	struct gpio_desc *gpio_disp;
+	struct gpio_desc *gpio_pwr;		// optional
+	struct gpio_descs *gpio_data;
+	bool gpio_cansleep;				// a line is on a sleeping chip, see GPIO_WRITE()
+	void __iomem *data_reg;			// optional, solomon,data-reg
+
+	int backend;					// BUS_BACKEND_*, see BusBackendTune()
+	u64 bus_rate[BUS_BACKEND_COUNT];	// measured words/s, 0 if not viable
+
+	// These vars are initialized in DispInit()
+	unsigned int	CurBackColor;
+	unsigned int	CurForeColor;
+	int				CurFontType;
+	sFONT			CurFontStruct;
+
+	// Copy of the background pixels on the glass (without sprites), maintained by
+	// the render functions so sprites can be composed without reading the panel
+	u16 *ShadowBuffer;
+	bool ShadowExact;				// every pixel of the glass is known, see FramePrepCopy()
+	struct bus_model bus_model;
+	bool mock;						// selftest running, the bus goes to the model
+	bool loopback;					// the GPIOs are read back into the model, see loopback_show()
+	u64 loopback_errors;
+
+	struct workqueue_struct *wq;
+	struct delayed_work work;
+	// Serializes users of the bus: the update worker and the selftest
+	struct mutex bus_lock;
+
+	// Every request bumps submit_seq, the worker publishes the value it saw before
+	// taking the pending requests in done_seq once they are on the glass
+	atomic_t submit_seq;
+	u32 done_seq;
+	wait_queue_head_t done_wait;
+
+	// Pending SSD1963_IOC_SUBMIT rectangles of the frame buffer, one per
+	// priority class, see submit_drain()
+	spinlock_t submit_lock;
+	struct ssd1963_submit fb_damage[SSD1963_PRIO_COUNT];
+	bool fb_damage_pending[SSD1963_PRIO_COUNT];
+	// SSD1963_IOC_COMPRESSED rectangles in queue order, see compressed_drain()
+	struct list_head compressed;
+	int compressed_count;
+
+	struct list_head img_cache;		// most recently used first
+	struct mutex img_cache_lock;
+	size_t img_cache_used;
+	// pending SSD1963_IOC_CACHE_SHOW request, consumed by ssd1963_update()
+	struct ssd1963_cache_show img_show;
+	bool img_show_pending;
+
+	struct sprite sprites[SSD1963_SPRITE_MAX];
+	struct mutex sprite_lock;
+	u16 sprite_scratch[SSD1963_SPRITE_MAX_DIM * SSD1963_SPRITE_MAX_DIM];
+
+	struct ssd1963_stats stats;
+	struct dentry *debugfs;
+
+	// The frame buffer lives as long as the panel. write() stages the user data
+	// and publishes it under fb_seq; the worker copies what it transfers into
+	// xfer under the same seqcount, so it never sends a half-written frame and
+	// writers never wait for the bus.
+	struct mmap_info info;
+	char *framebuffer;
+	struct mutex fb_lock;			// serializes write(), owns fb_stage
+	seqcount_t fb_seq;
+	char *fb_stage;
+	char *xfer;						// DISP_PIX_TOT * 2 bytes, update worker only
+	u16 *prep_words;				// DISP_PIX_TOT words, NULL without prep threads
+	struct prep_stripe prep[PREP_STRIPES];
+
+	// SSD1963_IOC_FORMAT and SSD1963_IOC_PALETTE. The format changes under
+	// fb_lock and bus_lock, the palette under bus_lock so a rectangle is drawn
+	// with one palette.
+	u32 format;
+	u16 palette[SSD1963_PALETTE_SIZE];
+
+	// SSD1963_IOC_STREAM, see stream_send(). The configuration and the ring
+	// change under fb_lock and bus_lock, the slot states under stream_lock.
+	struct ssd1963_stream stream;	// nbufs 0: no stream
+	struct file *stream_owner;
+	char *stream_ring;				// nbufs frames of stream_bytes
+	size_t stream_bytes;
+	spinlock_t stream_lock;
+	u8 stream_state[SSD1963_STREAM_MAX_BUFS];
+	u32 stream_seq[SSD1963_STREAM_MAX_BUFS];	// queue order of the slots
+	u32 stream_next;
+	bool stream_window;				// the address window is the stream window
+	bool stream_window_mock;		// ... of the bus model
+};
+
+static DEFINE_IDA(ssd1963_ida);
+
+// The bus goes to the model for every panel with busMock, or for one panel
+// while its selftest runs
+#define BUS_MOCK()      (p_busMock || lcd->mock)
 
-static struct delayed_work ssd1963_work;
+static int fbinit(struct ssd1963 *lcd);
+static void fbexit(struct ssd1963 *lcd);
+static void fbfree(struct ssd1963 *lcd);
+
+static void capture_record(struct ssd1963 *lcd, u16 type, int col, int row, int width, int height, u32 id, u32 arg,
+                           const char *pixels, int stride);
 
 #define SSD1963_PERIOD      (HZ / 10)
-static void ssd1963_update_all(void);
-static void ssd1963_update(struct work_struct *unused);
+static void ssd1963_update_all(struct ssd1963 *lcd);
+static void ssd1963_update(struct work_struct *work);
+
+// Run the update worker now instead of waiting for the next period
+static void ssd1963_kick(struct ssd1963 *lcd)
+{
+    atomic_inc(&lcd->submit_seq);
+    mod_delayed_work(lcd->wq, &lcd->work, 0);
+}
 
-int DispFilledRectRender(int PosX, int PosY, int Width, int Height);
-void DispBackColorSet(unsigned int Color);
-void DispForeColorSet(unsigned int Color);
-void DispFontSet(int Font);
+int DispFilledRectRender(struct ssd1963 *lcd, int PosX, int PosY, int Width, int Height);
+void DispBackColorSet(struct ssd1963 *lcd, unsigned int Color);
+void DispForeColorSet(struct ssd1963 *lcd, unsigned int Color);
+void DispFontSet(struct ssd1963 *lcd, int Font);
+
+static void SpriteDamage(struct ssd1963 *lcd, int StartPosX, int EndPosX, int StartPosY, int EndPosY);
+
+static void WindowSet(struct ssd1963 *lcd, int StartCol, int EndCol, int StartRow, int EndRow);
+static void ColSet(struct ssd1963 *lcd, unsigned int StartCol, unsigned int EndCol);
+static void RowSet(struct ssd1963 *lcd, unsigned int StartRow, unsigned int EndRow);
+static void CmdWrite(struct ssd1963 *lcd, char val);
+static void DataWrite(struct ssd1963 *lcd, unsigned int val);
+static void DataRepeat(struct ssd1963 *lcd, unsigned int val, unsigned int count);
+static unsigned int DataRead(struct ssd1963 *lcd);
+
+// SSD1963 PLL: VCO = XTAL * (M + 1), 250MHz to 800MHz, PLL = VCO / (N + 1),
+// M up to 255 and N up to 31
+#define PLL_VCO_MIN		250000000ULL
+#define PLL_VCO_MAX		800000000ULL
+#define PLL_M_MAX		255
+#define PLL_N_MAX		31
+
+// Pick the M and N giving the PLL clock closest to pll_hz with the VCO in
+// range, the smallest N on a tie. Returns false if no pair fits.
+static bool DispPllSolve(struct disp_panel *panel)
+{
+	u64		Vco;
+	u64		M1;
+	u64		Err;
+	u64		BestErr = U64_MAX;
+	u32		N;
+
+	for (N = 0; N <= PLL_N_MAX; N++)
+	{
+		// M + 1 rounded down, as the fixed N=2 setting always did
+		M1 = div_u64((u64)panel->pll_hz * (N + 1), panel->xtal_hz);
+		if (M1 < 1 || M1 - 1 > PLL_M_MAX)
+			continue;
+		Vco = (u64)panel->xtal_hz * M1;
+		if (Vco < PLL_VCO_MIN || Vco > PLL_VCO_MAX)
+			continue;
+		Err = (u64)panel->pll_hz * (N + 1) - Vco;	// M1 rounded down, Vco <= target
+		Err = div_u64(Err, N + 1);
+		if (Err < BestErr)
+		{
+			BestErr = Err;
+			panel->pll_m = M1 - 1;
+			panel->pll_n = N;
+		}
+	}
+	return BestErr != U64_MAX;
+}
+
+// Read the panel geometry and timing from the device tree. Properties:
+//   panel-timing         standard display timing node (resolution, porches,
+//                        sync lengths, optional clock-frequency)
+//   solomon,xtal-hz      reference clock, default 10MHz
+//   solomon,pll-hz       system clock, default 120MHz
+//   solomon,refresh-hz   refresh target used when panel-timing has no
+//                        clock-frequency
+static int DispPanelParse(struct ssd1963 *lcd)
+{
+	struct device		*dev = lcd->dev;
+	struct device_node	*np = dev->of_node;
+	struct display_timing	dt;
+	u32		refresh = 0;
+	bool	FixedClock = false;
+	u32		hactive, hfp, hbp, hsync;
+	u32		vactive, vfp, vbp, vsync;
+
+	of_property_read_u32(np, "solomon,xtal-hz", &lcd->panel.xtal_hz);
+	of_property_read_u32(np, "solomon,pll-hz", &lcd->panel.pll_hz);
+	of_property_read_u32(np, "solomon,refresh-hz", &refresh);
+
+	if (of_get_display_timing(np, "panel-timing", &dt) == 0)
+	{
+		hactive = dt.hactive.typ;
+		hfp = dt.hfront_porch.typ;
+		hbp = dt.hback_porch.typ;
+		hsync = dt.hsync_len.typ;
+		vactive = dt.vactive.typ;
+		vfp = dt.vfront_porch.typ;
+		vbp = dt.vback_porch.typ;
+		vsync = dt.vsync_len.typ;
+
+		// SSD1963 frame buffer is 864x480
+		if (!hactive || !vactive || hactive > 864 || vactive > 480 || !hsync || !vsync)
+		{
+			dev_err(dev, "Unsupported panel timing %ux%u\n", hactive, vactive);
+			return -EINVAL;
+		}
+
+		lcd->panel.col_max = hactive - 1;
+		lcd->panel.row_max = vactive - 1;
+		lcd->panel.ht = hactive + hfp + hbp + hsync;
+		lcd->panel.hps = hsync + hbp;
+		lcd->panel.hpw = hsync;
+		lcd->panel.lps = hfp;
+		lcd->panel.vt = vactive + vfp + vbp + vsync;
+		lcd->panel.vps = vsync + vbp;
+		lcd->panel.vpw = vsync;
+		lcd->panel.fps = vfp;
+		if (dt.pixelclock.typ)
+		{
+			lcd->panel.pclk_hz = dt.pixelclock.typ;
+			FixedClock = true;
+		}
+	}
 
-static void ColSet(unsigned int StartCol, unsigned int EndCol);
-static void RowSet(unsigned int StartRow, unsigned int EndRow);
-static void CmdWrite(char val);
-static void DataWrite(unsigned int val);
+	// Pixel clock from the refresh target when the panel node does not fix it
+	if (refresh && !FixedClock)
+		lcd->panel.pclk_hz = lcd->panel.ht * lcd->panel.vt * refresh;
 
-void DispInit(void)
+	if (!lcd->panel.xtal_hz || !lcd->panel.pll_hz || lcd->panel.pclk_hz > lcd->panel.pll_hz)
+	{
+		dev_err(dev, "Invalid clocks: xtal %u, PLL %u, PCLK %u\n",
+				lcd->panel.xtal_hz, lcd->panel.pll_hz, lcd->panel.pclk_hz);
+		return -EINVAL;
+	}
+
+	if (!DispPllSolve(&lcd->panel))
+	{
+		dev_err(dev, "No PLL setting for %u Hz from a %u Hz reference\n",
+				lcd->panel.pll_hz, lcd->panel.xtal_hz);
+		return -EINVAL;
+	}
+
+	dev_info(dev, "Panel %dx%d, HT %u, VT %u, PCLK %u Hz\n", DISP_RES_HOR, DISP_RES_VER,
+			 lcd->panel.ht, lcd->panel.vt, lcd->panel.pclk_hz);
+
+	return 0;
+}
+
+void DispInit(struct ssd1963 *lcd)
 {
+	u32		Fpr;
+	int		i;
 
 	// PA0 - /RST signal, active low (asserted)
-    gpio_direction_output(LCD_RSTn_R, 0);
+    gpiod_direction_output_raw(lcd->gpio_rst, 0);
 
 	// PA1 - DISP signal, active high (deasserted)
-    gpio_direction_output(LCD_DISP_ON_R, 0);
+    gpiod_direction_output_raw(lcd->gpio_disp, 0);
 
 	// PA4 - BL_E signal, active high (deasserted)
     //gpio_direction_output(, 0);
 
 	// PA5 - /CS signal, active low (deasserted)
-    gpio_direction_output(LCD_CSn, 1);
+    gpiod_direction_output_raw(lcd->gpio_cs, 1);
 
 	// PA6 - RS signal, 0:cmd, 1:data (data)
-    gpio_direction_output(LCD_RS, 1);
+    gpiod_direction_output_raw(lcd->gpio_rs, 1);
 
 	// PA7 - /WR signal, active low (deasserted)
-    gpio_direction_output(LCD_WRn, 1);
+    gpiod_direction_output_raw(lcd->gpio_wr, 1);
 
 	// PA8 - /RD signal, active low (deasserted)
-    gpio_direction_output(LCD_RDn, 1);
-
-	// PB[7:0] - DB[0:7] (low)
-    gpio_direction_output(LCD_D00, 0);
-    gpio_direction_output(LCD_D01, 0);
-    gpio_direction_output(LCD_D02, 0);
-    gpio_direction_output(LCD_D03, 0);
-    gpio_direction_output(LCD_D04, 0);
-    gpio_direction_output(LCD_D05, 0);
-    gpio_direction_output(LCD_D06, 0);
-    gpio_direction_output(LCD_D07, 0);
-
-	// PC[7:0] - DB[15:8] (low)
-    gpio_direction_output(LCD_D08, 0);
-    gpio_direction_output(LCD_D09, 0);
-    gpio_direction_output(LCD_D10, 0);
-    gpio_direction_output(LCD_D11, 0);
-    gpio_direction_output(LCD_D12, 0);
-    gpio_direction_output(LCD_D13, 0);
-    gpio_direction_output(LCD_D14, 0);
-    gpio_direction_output(LCD_D15, 0);
+    gpiod_direction_output_raw(lcd->gpio_rd, 1);
+
+	// DB[15:0] (low)
+    for (i = 0; i < LCD_DATA_PINS; i++)
+        gpiod_direction_output_raw(lcd->gpio_data->desc[i], 0);
 
     // LCD power enable
-    gpio_direction_output(LCD_PWR_EN, 0);
+    gpiod_direction_output_raw(lcd->gpio_pwr, 0);
 
 	// PC8 - debug pin (low)
     //gpio_direction_output(, 0);
@@ -240,81 +628,83 @@ void DispInit(void)
 	RST_DIS();
 	mdelay(100);
 
-	// Set PLL: M=35, N=2 => (10MHz * 36) / 3 = 120MHz
-	CmdWrite(0xE2);
-	DataWrite(0x23);
-	DataWrite(0x02);
-	DataWrite(0x04);
+	// Set PLL: PLL = (XTAL * (M + 1)) / (N + 1), M and N from DispPllSolve()
+	// e.g. M=35, N=2 => (10MHz * 36) / 3 = 120MHz
+	CmdWrite(lcd, 0xE2);
+	DataWrite(lcd, lcd->panel.pll_m);
+	DataWrite(lcd, lcd->panel.pll_n);
+	DataWrite(lcd, 0x04);
 
 	// Start the PLL, use reference clock as system clock
-	CmdWrite(0xE0);
-	DataWrite(0x01);
+	CmdWrite(lcd, 0xE0);
+	DataWrite(lcd, 0x01);
 	mdelay(1);
 
 	// PLL has locked, use the PLL as the system clock
-	CmdWrite(0xE0);
-	DataWrite(0x03);
+	CmdWrite(lcd, 0xE0);
+	DataWrite(lcd, 0x03);
 	mdelay(5);
 
 	// Soft reset, preserves registers 0xE0-0xE5
-	CmdWrite(0x01);
+	CmdWrite(lcd, 0x01);
 	mdelay(5);
 
 	// Set pixel clock: PCLK = (PLL * (FPR + 1)) / 0x100000
-	// FPR = 0x1FFFF => PCLK = 120MHz / 8 = 15MHz
-	CmdWrite(0xE6);
-	DataWrite(0x01);
-	DataWrite(0xFF);
-	DataWrite(0xFF);
+	// e.g. FPR = 0x1FFFF => PCLK = 120MHz / 8 = 15MHz
+	Fpr = (u32)div_u64((u64)lcd->panel.pclk_hz << 20, lcd->panel.pll_hz) - 1;
+	CmdWrite(lcd, 0xE6);
+	DataWrite(lcd, (Fpr >> 16) & 0xFF);
+	DataWrite(lcd, (Fpr >> 8) & 0xFF);
+	DataWrite(lcd,  Fpr       & 0xFF);
 
 	// Set LCD mode
-	CmdWrite(0xB0);
+	CmdWrite(lcd, 0xB0);
 	// 24-bit LCD data, no FRC, no dithering, pixel data latch on falling edge,
 	// HSYNC active low, VSYNC active low
-	DataWrite(0x20);
+	DataWrite(lcd, 0x20);
 	// TFT mode
-	DataWrite(0x00);
+	DataWrite(lcd, 0x00);
 	// Set panel horizontal size: HDP = 479 => 480 pixels
-	DataWrite((479 >> 8) & 0xFF);
-	DataWrite(479 & 0xFF);
+	DataWrite(lcd, (lcd->panel.col_max >> 8) & 0xFF);
+	DataWrite(lcd,  lcd->panel.col_max       & 0xFF);
 	// Set panel vertical size: VDP = 271 => 272 pixels
-	DataWrite((271 >> 8) & 0xFF);
-	DataWrite(271 & 0xFF);
+	DataWrite(lcd, (lcd->panel.row_max >> 8) & 0xFF);
+	DataWrite(lcd,  lcd->panel.row_max       & 0xFF);
 	// Set even/odd RGB sequence for serial TFT (not applicable)
-	DataWrite(0x00);
+	DataWrite(lcd, 0x00);
 
 	// Set HSYNC parameters (in pixels)
-	CmdWrite(0xB4);
+	CmdWrite(lcd, 0xB4);
 	// Set horizontal total period: HT = 525
-	DataWrite((525 >> 8) & 0xFF);
-	DataWrite( 525       & 0xFF);
+	DataWrite(lcd, (lcd->panel.ht >> 8) & 0xFF);
+	DataWrite(lcd,  lcd->panel.ht       & 0xFF);
 	// Set HSYNC pulse width + horizontal back porch: HPS = 43
-	DataWrite((43 >> 8) & 0xFF);
-	DataWrite( 43       & 0xFF);
+	DataWrite(lcd, (lcd->panel.hps >> 8) & 0xFF);
+	DataWrite(lcd,  lcd->panel.hps       & 0xFF);
 	// Set HSYNC pulse width: HPW = 41
-	DataWrite(41);
+	DataWrite(lcd, lcd->panel.hpw);
 	// Set horizontal front porch: LPS = 2
-	DataWrite((2 >> 8) & 0xFF);
-	DataWrite( 2       & 0xFF);
+	DataWrite(lcd, (lcd->panel.lps >> 8) & 0xFF);
+	DataWrite(lcd,  lcd->panel.lps       & 0xFF);
 	// Set HSYNC pulse sub-pixel start position: LPSPP = 0
-	DataWrite(0x00);
+	DataWrite(lcd, 0x00);
 
 	// Set VSYNC parameters (in lines)
-	CmdWrite(0xB6);
+	CmdWrite(lcd, 0xB6);
 	// Set vertical total period: VT = 286
-	DataWrite((286 >> 8) & 0xFF);
-	DataWrite( 286       & 0xFF);
+	DataWrite(lcd, (lcd->panel.vt >> 8) & 0xFF);
+	DataWrite(lcd,  lcd->panel.vt       & 0xFF);
 	// Set VSYNC pulse width + vertical back porch: VPS = 12
-	DataWrite((12 >> 8) & 0xFF);
-	DataWrite( 12       & 0xFF);
+	DataWrite(lcd, (lcd->panel.vps >> 8) & 0xFF);
+	DataWrite(lcd,  lcd->panel.vps       & 0xFF);
 	// Set VSYNC pulse width: VPW = 10
-	DataWrite(10);
+	DataWrite(lcd, lcd->panel.vpw);
 	// Set vertical front porch: FPS = 2
-	DataWrite((2 >> 8) & 0xFF);
-	DataWrite( 2       & 0xFF);
+	DataWrite(lcd, (lcd->panel.fps >> 8) & 0xFF);
+	DataWrite(lcd,  lcd->panel.fps       & 0xFF);
 
 	// Set address mode
-	CmdWrite(0x36);
+	CmdWrite(lcd, 0x36);
 	// Page address order: top-to-bottom
 	// Column address order: left-to-right
 	// Page/Column order: normal
@@ -323,23 +713,25 @@ void DispInit(void)
 	// Line data latch order: left-to-right
 	// Flip horizontal: flip
 	// Flip vertical: flip
-	DataWrite(0x03);	// 0x00 for normal horizontal & vertical (not flipped)
+	DataWrite(lcd, 0x03);	// 0x00 for normal horizontal & vertical (not flipped)
 
 	// Set pixel data interface: 16-bit 565 format
-	CmdWrite(0xF0);
-	DataWrite(0x03);
+	CmdWrite(lcd, 0xF0);
+	DataWrite(lcd, 0x03);
 
 	// Delay before use
 	mdelay(5);
 
 	// Optional - fill the entire display with black
-	DispForeColorSet(DISP_BLK);
-	DispFilledRectRender(DISP_COL_MIN, DISP_ROW_MIN, DISP_RES_HOR, DISP_RES_VER);
+	DispForeColorSet(lcd, DISP_BLK);
+	DispFilledRectRender(lcd, DISP_COL_MIN, DISP_ROW_MIN, DISP_RES_HOR, DISP_RES_VER);
+	// The whole glass went over the bus, the shadow matches it from here
+	lcd->ShadowExact = lcd->ShadowBuffer && !BUS_MOCK();
 
 	// Optional - set up default colors and font
-	DispBackColorSet(DISP_BLK);
-	DispForeColorSet(DISP_WHT_MAX);
-	DispFontSet(DISP_FONT_24);
+	DispBackColorSet(lcd, DISP_BLK);
+	DispForeColorSet(lcd, DISP_WHT_MAX);
+	DispFontSet(lcd, DISP_FONT_24);
 
 	// Enable the display in hardware
 	DISP_ENA();
@@ -351,92 +743,191 @@ void DispInit(void)
 	//BL_ENA();
 }
 
-void DispOff(void)
+// Take over a panel already configured by U-Boot: put the control lines in
+// their running state without pulsing reset, then read the controller state
+// back. Returns false if the panel must be initialized with DispInit().
+bool DispAdopt(struct ssd1963 *lcd)
+{
+	unsigned int	PowerMode;
+	unsigned int	PllStatus;
+	unsigned int	AddrMode;
+	unsigned int	PixelFormat;
+	unsigned int	LcdMode[7];
+	int				i;
+
+	// Deasserted /RST, DISP on, /CS asserted (forever), data mode, /WR and /RD idle
+	if (!BUS_MOCK())
+	{
+        gpiod_direction_output_raw(lcd->gpio_rst, 1);
+        gpiod_direction_output_raw(lcd->gpio_disp, 1);
+        gpiod_direction_output_raw(lcd->gpio_cs, 0);
+        gpiod_direction_output_raw(lcd->gpio_rs, 1);
+        gpiod_direction_output_raw(lcd->gpio_wr, 1);
+        gpiod_direction_output_raw(lcd->gpio_rd, 1);
+        for (i = 0; i < LCD_DATA_PINS; i++)
+            gpiod_direction_output_raw(lcd->gpio_data->desc[i], 0);
+        gpiod_direction_output_raw(lcd->gpio_pwr, 0);
+	}
+
+	// Get power mode: A[2] display on, A[4] sleep out
+	CmdWrite(lcd, 0x0A);
+	PowerMode = DataRead(lcd);
+
+	// Get PLL status: A[2] PLL locked
+	CmdWrite(lcd, 0xE4);
+	PllStatus = DataRead(lcd);
+
+	// Get address mode and pixel data interface, the frames are drawn for
+	// the flipped 16-bit 565 setup of DispInit()
+	CmdWrite(lcd, 0x0B);
+	AddrMode = DataRead(lcd);
+	CmdWrite(lcd, 0xF1);
+	PixelFormat = DataRead(lcd) & 0x07;
+
+	// Get LCD mode, HDP and VDP must match the panel we drive
+	CmdWrite(lcd, 0xB1);
+	for (i = 0; i < 7; i++)
+		LcdMode[i] = DataRead(lcd);
+
+	dev_info(lcd->dev, "Power mode 0x%02x, PLL status 0x%02x, address mode 0x%02x, pixel format %u, %ux%u\n",
+			PowerMode, PllStatus, AddrMode, PixelFormat,
+			((LcdMode[2] << 8) | LcdMode[3]) + 1, ((LcdMode[4] << 8) | LcdMode[5]) + 1);
+
+	if (!(PowerMode & 0x04) || !(PowerMode & 0x10) || !(PllStatus & 0x04))
+		return false;
+	if (AddrMode != 0x03 || PixelFormat != 0x03)
+		return false;
+	if ((((LcdMode[2] << 8) | LcdMode[3]) != DISP_COL_MAX) ||
+		(((LcdMode[4] << 8) | LcdMode[5]) != DISP_ROW_MAX))
+		return false;
+
+	// Optional - set up default colors and font
+	DispBackColorSet(lcd, DISP_BLK);
+	DispForeColorSet(lcd, DISP_WHT_MAX);
+	DispFontSet(lcd, DISP_FONT_24);
+
+	return true;
+}
+
+void DispOff(struct ssd1963 *lcd)
 {
 	// Disable the display in software
-	CmdWrite(0x28);
+	CmdWrite(lcd, 0x28);
 }
 
-void DispOn(void)
+void DispOn(struct ssd1963 *lcd)
 {
 	// Enable the display in software
-	CmdWrite(0x29);
+	CmdWrite(lcd, 0x29);
 }
 
-void DispBackColorSet(unsigned int Color)
+void DispBackColorSet(struct ssd1963 *lcd, unsigned int Color)
 {
-	CurBackColor = Color;
+	lcd->CurBackColor = Color;
 }
 
-unsigned int DispBackColorGet(void)
+unsigned int DispBackColorGet(struct ssd1963 *lcd)
 {
-	return CurBackColor;
+	return lcd->CurBackColor;
 }
 
-void DispForeColorSet(unsigned int Color)
+void DispForeColorSet(struct ssd1963 *lcd, unsigned int Color)
 {
-	CurForeColor = Color;
+	lcd->CurForeColor = Color;
 }
 
-unsigned int DispForeColorGet(void)
+unsigned int DispForeColorGet(struct ssd1963 *lcd)
 {
-	return CurForeColor;
+	return lcd->CurForeColor;
 }
 
-void DispFontSet(int Font)
+void DispFontSet(struct ssd1963 *lcd, int Font)
 {
-	CurFontType = Font;
+	lcd->CurFontType = Font;
 	switch (Font)
 	{
 	case DISP_FONT_8:
-		CurFontStruct = Font8;
+		lcd->CurFontStruct = Font8;
 		break;
 	case DISP_FONT_12:
-		CurFontStruct = Font12;
+		lcd->CurFontStruct = Font12;
 		break;
 	case DISP_FONT_16:
-		CurFontStruct = Font16;
+		lcd->CurFontStruct = Font16;
 		break;
 	case DISP_FONT_20:
-		CurFontStruct = Font20;
+		lcd->CurFontStruct = Font20;
 		break;
 	case DISP_FONT_24:
-		CurFontStruct = Font24;
+		lcd->CurFontStruct = Font24;
 		break;
 	default:
-		CurFontType = DISP_FONT_20;
-		CurFontStruct = Font20;
+		lcd->CurFontType = DISP_FONT_20;
+		lcd->CurFontStruct = Font20;
 		break;
 	}
 }
 
-int DispFontGet(void)
+int DispFontGet(struct ssd1963 *lcd)
 {
-	return CurFontType;
+	return lcd->CurFontType;
+}
+
+// ByteArray points at the source pixel of (StartPosX, StartPosY), Stride is
+// the source width in pixels
+static void ShadowRectCopy(struct ssd1963 *lcd, int StartPosX, int EndPosX, int StartPosY, int EndPosY,
+						   const char * ByteArray, int Stride)
+{
+	int		Row;
+	int		Col;
+	u16		*Dst;
+	const char	*Src;
+
+	if (!lcd->ShadowBuffer)
+		return;
+
+	for (Row = StartPosY; Row <= EndPosY; Row++, ByteArray += Stride * 2)
+	{
+		Dst = lcd->ShadowBuffer + (Row * DISP_RES_HOR) + StartPosX;
+		Src = ByteArray;
+		for (Col = StartPosX; Col <= EndPosX; Col++, Src += 2)
+		{
+			*Dst++ = (*(Src + 1) << 8) | (u8)*Src;
+		}
+	}
 }
 
-#define GPIO_ORIG       1
-#define GPIO_WRITEL     0
-#define GPIO_POINTER    0
+static void ShadowRectFill(struct ssd1963 *lcd, int StartPosX, int EndPosX, int StartPosY, int EndPosY, u16 Color)
+{
+	int		Row;
+	int		Col;
+	u16		*Dst;
+
+	if (!lcd->ShadowBuffer)
+		return;
+
+	for (Row = StartPosY; Row <= EndPosY; Row++)
+	{
+		Dst = lcd->ShadowBuffer + (Row * DISP_RES_HOR) + StartPosX;
+		for (Col = StartPosX; Col <= EndPosX; Col++)
+		{
+			*Dst++ = Color;
+		}
+	}
+}
 
-int DispRectCopy(int PosX, int PosY, int Width, int Height, const char * ByteArray)
+int DispRectCopy(struct ssd1963 *lcd, int PosX, int PosY, int Width, int Height, const char * ByteArray)
 {
 	int		StartPosX;
 	int		EndPosX;
 	int		StartPosY;
 	int		EndPosY;
 	int		PixelCount;
+	int		CurCol;
+	int		CurRow;
+	const char	*Src;
 	int		RetVal = DISP_RENDER_RESULT_FULL;
 
-#if GPIO_WRITEL
-    void __iomem *GPIO4_BADDR;
-#elif GPIO_POINTER
-    volatile u32 *GPIO4_BADDR = 0x3023000;
-#endif
-#if GPIO_WRITEL || GPIO_POINTER
-    u32 reg, val;
-#endif
-
 	StartPosX = (PosX > DISP_COL_MIN) ? PosX : DISP_COL_MIN;
 	EndPosX = ((PosX + Width - 1) < DISP_COL_MAX) ? (PosX + Width - 1) : DISP_COL_MAX;
 	StartPosY = (PosY > DISP_ROW_MIN) ? PosY : DISP_ROW_MIN;
@@ -454,56 +945,143 @@ int DispRectCopy(int PosX, int PosY, int Width, int Height, const char * ByteArr
 		RetVal = DISP_RENDER_RESULT_PART;
 	}
 
-	// Copy the rectangle
-	ColSet(StartPosX, EndPosX);
-	RowSet(StartPosY, EndPosY);
-	CmdWrite(0x2C);		// memory write
+	// Skip the source pixels clipped off the top and left
+	ByteArray += (((StartPosY - PosY) * Width) + (StartPosX - PosX)) * 2;
 
-#if GPIO_WRITEL
-    GPIO4_BADDR = ioremap(0x3023000, 1);
-#endif
-	while (PixelCount--)
+	ShadowRectCopy(lcd, StartPosX, EndPosX, StartPosY, EndPosY, ByteArray, Width);
+	lcd->stats.pixels += PixelCount;
+
+	// Copy the rectangle, one source row (Width pixels) per window row
+	WindowSet(lcd, StartPosX, EndPosX, StartPosY, EndPosY);
+	for (CurRow = StartPosY; CurRow <= EndPosY; CurRow++, ByteArray += Width * 2)
 	{
-#if GPIO_ORIG
-        //original method
-        DataWrite((*(ByteArray + 1) << 8) | *ByteArray);	// byte array is little endian
-#elif GPIO_WRITEL
-        //writel method
-        reg = readl(GPIO4_BADDR) & (~0x20000);
-        writel(reg, GPIO4_BADDR);   // assert write
-
-        reg &= 0xFFFF0000;
-        reg |= val & 0xFFFF;
-        writel(reg, GPIO4_BADDR);   //set new GPIO levels
-
-        reg |= 0x20000;
-        writel(reg, GPIO4_BADDR);   //deassert write to latch data
-
-#elif GPIO_POINTER
-        //pointers method
-        val = (*(ByteArray + 1) << 8) | *ByteArray;
-        reg = readl(GPIO4_BADDR) & (~0x20000);
-        *GPIO4_BADDR = reg;         // assert write
-
-        reg &= 0xFFFF0000;
-        reg |= val & 0xFFFF;
-        *GPIO4_BADDR = reg;         //set new GPIO levels
-        
-        
-        reg |= 0x20000;
-        *GPIO4_BADDR = reg;         //deassert write to latch data
-#endif
+		Src = ByteArray;
+		for (CurCol = StartPosX; CurCol <= EndPosX; CurCol++, Src += 2)
+			DataWrite(lcd, (*(Src + 1) << 8) | (u8)*Src);	// byte array is little endian
+	}
+	trace_ssd1963_xfer_end((EndPosX - StartPosX + 1) * (EndPosY - StartPosY + 1));
+
+	SpriteDamage(lcd, StartPosX, EndPosX, StartPosY, EndPosY);
+
+	return RetVal;
+}
+
+// Copy a rectangle out of a full-screen frame (stride DISP_RES_HOR pixels)
+int DispFrameCopy(struct ssd1963 *lcd, int PosX, int PosY, int Width, int Height, const char * Frame)
+{
+	int		StartPosX;
+	int		EndPosX;
+	int		StartPosY;
+	int		EndPosY;
+	int		CurCol;
+	int		CurRow;
+	const char	*Src;
+	u16		Pixel;
+	int		RetVal = DISP_RENDER_RESULT_FULL;
+
+	StartPosX = (PosX > DISP_COL_MIN) ? PosX : DISP_COL_MIN;
+	EndPosX = ((PosX + Width - 1) < DISP_COL_MAX) ? (PosX + Width - 1) : DISP_COL_MAX;
+	StartPosY = (PosY > DISP_ROW_MIN) ? PosY : DISP_ROW_MIN;
+	EndPosY = ((PosY + Height - 1) < DISP_ROW_MAX) ? (PosY + Height - 1) : DISP_ROW_MAX;
+
+	if ((EndPosX < DISP_COL_MIN) || (StartPosX > DISP_COL_MAX) ||
+		(EndPosY < DISP_ROW_MIN) || (StartPosY > DISP_ROW_MAX))
+	{
+		return DISP_RENDER_RESULT_NONE;
+	}
 
-		ByteArray += 2;
+	if ((EndPosX - StartPosX + 1) * (EndPosY - StartPosY + 1) < (Width * Height))
+	{
+		RetVal = DISP_RENDER_RESULT_PART;
 	}
-#if GPIO_WRITEL
-    iounmap(0x3023000);
-#endif
+
+	lcd->stats.pixels += (EndPosX - StartPosX + 1) * (EndPosY - StartPosY + 1);
+
+	WindowSet(lcd, StartPosX, EndPosX, StartPosY, EndPosY);
+	for (CurRow = StartPosY; CurRow <= EndPosY; CurRow++)
+	{
+		Src = Frame + (((CurRow * DISP_RES_HOR) + StartPosX) * 2);
+		for (CurCol = StartPosX; CurCol <= EndPosX; CurCol++, Src += 2)
+		{
+			Pixel = (*(Src + 1) << 8) | (u8)*Src;	// frame is little endian
+			DataWrite(lcd, Pixel);
+			if (lcd->ShadowBuffer)
+				lcd->ShadowBuffer[(CurRow * DISP_RES_HOR) + CurCol] = Pixel;
+		}
+	}
+	trace_ssd1963_xfer_end((EndPosX - StartPosX + 1) * (EndPosY - StartPosY + 1));
+
+	SpriteDamage(lcd, StartPosX, EndPosX, StartPosY, EndPosY);
 
 	return RetVal;
 }
 
-int DispFilledRectRender(int PosX, int PosY, int Width, int Height)
+// Send an already clipped window of palette indices, Src points at
+// (StartPosX, StartPosY) and rows are Stride bytes apart
+static void DispIndexedWrite(struct ssd1963 *lcd, int StartPosX, int EndPosX, int StartPosY, int EndPosY,
+							 const u8 * Src, int Stride)
+{
+	int		CurCol;
+	int		CurRow;
+	u16		Pixel;
+
+	lcd->stats.pixels += (EndPosX - StartPosX + 1) * (EndPosY - StartPosY + 1);
+
+	WindowSet(lcd, StartPosX, EndPosX, StartPosY, EndPosY);
+	for (CurRow = StartPosY; CurRow <= EndPosY; CurRow++, Src += Stride)
+	{
+		for (CurCol = StartPosX; CurCol <= EndPosX; CurCol++)
+		{
+			Pixel = lcd->palette[Src[CurCol - StartPosX]];
+			DataWrite(lcd, Pixel);
+			if (lcd->ShadowBuffer)
+				lcd->ShadowBuffer[(CurRow * DISP_RES_HOR) + CurCol] = Pixel;
+		}
+	}
+	trace_ssd1963_xfer_end((EndPosX - StartPosX + 1) * (EndPosY - StartPosY + 1));
+
+	SpriteDamage(lcd, StartPosX, EndPosX, StartPosY, EndPosY);
+}
+
+// DispFrameCopy() for an indexed frame (stride DISP_RES_HOR bytes)
+int DispFrameIndexedCopy(struct ssd1963 *lcd, int PosX, int PosY, int Width, int Height, const u8 * Frame)
+{
+	int		StartPosX = max(PosX, DISP_COL_MIN);
+	int		EndPosX = min(PosX + Width - 1, DISP_COL_MAX);
+	int		StartPosY = max(PosY, DISP_ROW_MIN);
+	int		EndPosY = min(PosY + Height - 1, DISP_ROW_MAX);
+
+	if ((EndPosX < StartPosX) || (EndPosY < StartPosY))
+		return DISP_RENDER_RESULT_NONE;
+
+	DispIndexedWrite(lcd, StartPosX, EndPosX, StartPosY, EndPosY,
+					 Frame + (StartPosY * DISP_RES_HOR) + StartPosX, DISP_RES_HOR);
+
+	if ((EndPosX - StartPosX + 1) * (EndPosY - StartPosY + 1) < (Width * Height))
+		return DISP_RENDER_RESULT_PART;
+	return DISP_RENDER_RESULT_FULL;
+}
+
+// DispRectCopy() for a packed rectangle of palette indices
+int DispRectIndexedCopy(struct ssd1963 *lcd, int PosX, int PosY, int Width, int Height, const u8 * Bytes)
+{
+	int		StartPosX = max(PosX, DISP_COL_MIN);
+	int		EndPosX = min(PosX + Width - 1, DISP_COL_MAX);
+	int		StartPosY = max(PosY, DISP_ROW_MIN);
+	int		EndPosY = min(PosY + Height - 1, DISP_ROW_MAX);
+
+	if ((EndPosX < StartPosX) || (EndPosY < StartPosY))
+		return DISP_RENDER_RESULT_NONE;
+
+	DispIndexedWrite(lcd, StartPosX, EndPosX, StartPosY, EndPosY,
+					 Bytes + ((StartPosY - PosY) * Width) + (StartPosX - PosX), Width);
+
+	if ((EndPosX - StartPosX + 1) * (EndPosY - StartPosY + 1) < (Width * Height))
+		return DISP_RENDER_RESULT_PART;
+	return DISP_RENDER_RESULT_FULL;
+}
+
+int DispFilledRectRender(struct ssd1963 *lcd, int PosX, int PosY, int Width, int Height)
 {
 	int		StartPosX;
 	int		EndPosX;
@@ -529,20 +1107,21 @@ int DispFilledRectRender(int PosX, int PosY, int Width, int Height)
 		RetVal = DISP_RENDER_RESULT_PART;
 	}
 
+	lcd->stats.pixels += PixelCount;
+
 	// Render the rectangle
-	ColSet(StartPosX, EndPosX);
-	RowSet(StartPosY, EndPosY);
-	CmdWrite(0x2C);		// memory write
-	while (PixelCount--)
-	{
-		DataWrite(CurForeColor);
-	}
+	WindowSet(lcd, StartPosX, EndPosX, StartPosY, EndPosY);
+	DataRepeat(lcd, lcd->CurForeColor, PixelCount);
+	trace_ssd1963_xfer_end((EndPosX - StartPosX + 1) * (EndPosY - StartPosY + 1));
+
+	ShadowRectFill(lcd, StartPosX, EndPosX, StartPosY, EndPosY, lcd->CurForeColor);
+	SpriteDamage(lcd, StartPosX, EndPosX, StartPosY, EndPosY);
 
 	return RetVal;
 }
 
 
-int DispCharRender(int PosX, int PosY, char Char)
+int DispCharRender(struct ssd1963 *lcd, int PosX, int PosY, char Char)
 {
 	char            BitMask;
 	int			    CurByte;
@@ -554,12 +1133,13 @@ int DispCharRender(int PosX, int PosY, char Char)
 	int			    FontRowEnd;
 	int			    FontRowBytes;
 	char            *FontBytePtr;
+	unsigned int    Color;
 
 	// Determine the bounding rectangle for the complete character
 	FontColStart = PosX;
-	FontColEnd = PosX + CurFontStruct.Width - 1;
+	FontColEnd = PosX + lcd->CurFontStruct.Width - 1;
 	FontRowStart = PosY;
-	FontRowEnd = PosY + CurFontStruct.Height - 1;
+	FontRowEnd = PosY + lcd->CurFontStruct.Height - 1;
 
 	// Check if the character is completely outside of the display
 	if ((FontColEnd < DISP_COL_MIN) || (FontColStart > DISP_COL_MAX) ||
@@ -582,15 +1162,14 @@ int DispCharRender(int PosX, int PosY, char Char)
 	FontRowEnd   = (FontRowEnd   > DISP_ROW_MAX) ? DISP_ROW_MAX : FontRowEnd;
 
 	// Determine the number of bytes per row and the first byte in the table for the char
-	FontRowBytes = (CurFontStruct.Width / 8) + 1;
-	FontBytePtr = (char *) CurFontStruct.table +					// start of table
-				  (Char * CurFontStruct.Height * FontRowBytes) +	// start of char
+	FontRowBytes = (lcd->CurFontStruct.Width / 8) + 1;
+	FontBytePtr = (char *) lcd->CurFontStruct.table +					// start of table
+				  (Char * lcd->CurFontStruct.Height * FontRowBytes) +	// start of char
 				  ((FontRowStart - PosY) * FontRowBytes);			// first displayed row
 
-	ColSet(FontColStart, FontColEnd);
-	RowSet(FontRowStart, FontRowEnd);
+	lcd->stats.pixels += (FontColEnd - FontColStart + 1) * (FontRowEnd - FontRowStart + 1);
 
-	CmdWrite(0x2C);		// memory write
+	WindowSet(lcd, FontColStart, FontColEnd, FontRowStart, FontRowEnd);
 
 	for (CurRow = FontRowStart; CurRow <= FontRowEnd; CurRow++)
 	{
@@ -601,16 +1180,22 @@ int DispCharRender(int PosX, int PosY, char Char)
 			{
 				if ((CurCol >= FontColStart) && (CurCol <= FontColEnd))
 				{
-					DataWrite(((*FontBytePtr) & BitMask ? CurForeColor : CurBackColor));
+					Color = ((*FontBytePtr) & BitMask ? lcd->CurForeColor : lcd->CurBackColor);
+					DataWrite(lcd, Color);
+					if (lcd->ShadowBuffer)
+						lcd->ShadowBuffer[(CurRow * DISP_RES_HOR) + CurCol] = Color;
 				}
 			}
 			FontBytePtr++;
 		}
 	}
 
+	trace_ssd1963_xfer_end((FontColEnd - FontColStart + 1) * (FontRowEnd - FontRowStart + 1));
+	SpriteDamage(lcd, FontColStart, FontColEnd, FontRowStart, FontRowEnd);
+
 	// Determine if a partial character was rendered
-	if (((FontColEnd - FontColStart + 1) < CurFontStruct.Width) ||
-		((FontRowEnd - FontRowStart + 1) < CurFontStruct.Height))
+	if (((FontColEnd - FontColStart + 1) < lcd->CurFontStruct.Width) ||
+		((FontRowEnd - FontRowStart + 1) < lcd->CurFontStruct.Height))
 	{
 		return DISP_RENDER_RESULT_PART;
 	}
@@ -618,249 +1203,2559 @@ int DispCharRender(int PosX, int PosY, char Char)
 	return DISP_RENDER_RESULT_FULL;
 }
 
-static void ColSet(unsigned int StartCol, unsigned int EndCol)
+// Send the pixels of an already clipped window, without touching ShadowBuffer
+static void DispRectWrite(struct ssd1963 *lcd, int StartPosX, int EndPosX, int StartPosY, int EndPosY, const u16 * Pixels)
+{
+	int		PixelCount = (EndPosX - StartPosX + 1) * (EndPosY - StartPosY + 1);
+
+	lcd->stats.pixels += PixelCount;
+
+	WindowSet(lcd, StartPosX, EndPosX, StartPosY, EndPosY);
+	while (PixelCount--)
+	{
+		DataWrite(lcd, *Pixels++);
+	}
+	trace_ssd1963_xfer_end((EndPosX - StartPosX + 1) * (EndPosY - StartPosY + 1));
+}
+
+// Open an address window and start a memory write, pixels follow with DataWrite()
+static void WindowSet(struct ssd1963 *lcd, int StartCol, int EndCol, int StartRow, int EndRow)
+{
+	lcd->stream_window = false;
+	trace_ssd1963_window(StartCol, EndCol, StartRow, EndRow);
+	ColSet(lcd, StartCol, EndCol);
+	RowSet(lcd, StartRow, EndRow);
+	CmdWrite(lcd, 0x2C);		// memory write
+	trace_ssd1963_xfer_start((EndCol - StartCol + 1) * (EndRow - StartRow + 1));
+}
+
+static void ColSet(struct ssd1963 *lcd, unsigned int StartCol, unsigned int EndCol)
+{
+	CmdWrite(lcd, 0x2A);
+	DataWrite(lcd, StartCol >> 8);
+	DataWrite(lcd, StartCol);
+	DataWrite(lcd, EndCol >> 8);
+	DataWrite(lcd, EndCol);
+}
+
+
+static void RowSet(struct ssd1963 *lcd, unsigned int StartRow, unsigned int EndRow)
+{
+	lcd->stats.windows++;
+	CmdWrite(lcd, 0x2B);
+	DataWrite(lcd, StartRow >> 8);
+	DataWrite(lcd, StartRow);
+	DataWrite(lcd, EndRow >> 8);
+	DataWrite(lcd, EndRow);
+}
+
+//############################## bus model ################################
+// In-memory model of the SSD1963 command/data interface, used instead of the
+// GPIOs when the busMock parameter is set. It decodes the column/page address
+// and memory write commands into a panel-sized pixel array, so rendering can
+// be checked pixel by pixel and timed on any machine.
+//#########################################################################
+
+static int BusModelAlloc(struct ssd1963 *lcd)
+{
+    if (!lcd->bus_model.mem)
+        lcd->bus_model.mem = vzalloc(DISP_PIX_TOT * sizeof(u16));
+    return lcd->bus_model.mem ? 0 : -ENOMEM;
+}
+
+static void BusModelCmd(struct ssd1963 *lcd, u8 val)
+{
+    lcd->bus_model.cmd = val;
+    lcd->bus_model.param = 0;
+    if (val == 0x2C)
+    {
+        lcd->bus_model.col = lcd->bus_model.sc;
+        lcd->bus_model.row = lcd->bus_model.sr;
+    }
+}
+
+static void BusModelData(struct ssd1963 *lcd, unsigned int val)
+{
+    int param = lcd->bus_model.param++;
+
+    switch (lcd->bus_model.cmd)
+    {
+    case 0x2A:  //set column address
+    case 0x2B:  //set page address
+    {
+        int *start = (lcd->bus_model.cmd == 0x2A) ? &lcd->bus_model.sc : &lcd->bus_model.sr;
+        int *end = (lcd->bus_model.cmd == 0x2A) ? &lcd->bus_model.ec : &lcd->bus_model.er;
+
+        if (param == 0)
+            *start = (val & 0xFF) << 8;
+        else if (param == 1)
+            *start |= val & 0xFF;
+        else if (param == 2)
+            *end = (val & 0xFF) << 8;
+        else if (param == 3)
+            *end |= val & 0xFF;
+        break;
+    }
+    case 0x2C:  //memory write, wraps inside the window like the controller
+        if (lcd->bus_model.mem && lcd->bus_model.col <= DISP_COL_MAX && lcd->bus_model.row <= DISP_ROW_MAX)
+            lcd->bus_model.mem[(lcd->bus_model.row * DISP_RES_HOR) + lcd->bus_model.col] = val & 0xFFFF;
+        if (++lcd->bus_model.col > lcd->bus_model.ec)
+        {
+            lcd->bus_model.col = lcd->bus_model.sc;
+            if (++lcd->bus_model.row > lcd->bus_model.er)
+                lcd->bus_model.row = lcd->bus_model.sr;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// Status reads describe a running panel of the configured geometry
+static unsigned int BusModelRead(struct ssd1963 *lcd)
 {
-	CmdWrite(0x2A);
-	DataWrite(StartCol >> 8);
-	DataWrite(StartCol);
-	DataWrite(EndCol >> 8);
-	DataWrite(EndCol);
+    int param = lcd->bus_model.param++;
+
+    switch (lcd->bus_model.cmd)
+    {
+    case 0x0A:  //get power mode: display on, sleep out
+        return 0x14;
+    case 0xE4:  //get PLL status: locked
+        return 0x04;
+    case 0x0B:  //get address mode: flipped, as set by DispInit()
+        return 0x03;
+    case 0xF1:  //get pixel data interface: 16-bit 565
+        return 0x03;
+    case 0xB1:  //get LCD mode
+        switch (param)
+        {
+        case 2: return (DISP_COL_MAX >> 8) & 0xFF;
+        case 3: return DISP_COL_MAX & 0xFF;
+        case 4: return (DISP_ROW_MAX >> 8) & 0xFF;
+        case 5: return DISP_ROW_MAX & 0xFF;
+        default: return 0;
+        }
+    default:
+        return 0;
+    }
 }
 
+//#########################################################################
 
-static void RowSet(unsigned int StartRow, unsigned int EndRow)
+// Read the bus lines back after a write strobe and decode the word into the
+// bus model. Used with loopback set, on gpio-sim lines or on a board whose
+// GPIO controller reports output levels. The reads are not counted in
+// stats.gpio_calls.
+static void LoopbackSample(struct ssd1963 *lcd)
 {
-	CmdWrite(0x2B);
-	DataWrite(StartRow >> 8);
-	DataWrite(StartRow);
-	DataWrite(EndRow >> 8);
-	DataWrite(EndRow);
+    unsigned int val = 0, i;
+    int level;
+
+    if(!lcd->gpio_data || GPIO_READ(lcd->gpio_wr) != 1)
+    {
+        lcd->loopback_errors++;     //write strobe still asserted
+        return;
+    }
+    for(i = 0; i < LCD_DATA_PINS; i++)
+    {
+        level = GPIO_READ(lcd->gpio_data->desc[i]);
+        if(level < 0)
+        {
+            lcd->loopback_errors++;
+            return;
+        }
+        val |= (level ? 1 : 0) << i;
+    }
+
+    if(GPIO_READ(lcd->gpio_rs))
+        BusModelData(lcd, val);
+    else
+        BusModelCmd(lcd, val & 0xFF);
 }
 
-static void DataWriteLower(unsigned int val)
+static void DataWriteLower(struct ssd1963 *lcd, unsigned int val)
 {
     unsigned int temp = val, i = 0;
     for(i = 0; i < 8; i++)
     {
-        __gpio_set_value(LCD_D00 + i, temp & 0x01);
+        GPIO_SET(lcd->gpio_data->desc[i], temp & 0x01);
         temp = temp >> 1;
     }
 }
 
-static void DataWriteUpper(unsigned int val)
+static void DataWriteUpper(struct ssd1963 *lcd, unsigned int val)
 {
     unsigned int temp = val, i = 0;
     for(i = 0; i < 8; i++)
     {
-        __gpio_set_value(LCD_D08 + i, temp & 0x01);
+        GPIO_SET(lcd->gpio_data->desc[8 + i], temp & 0x01);
         temp = temp >> 1;
     }
 }
 
-static void CmdWrite(char val)
+static void CmdWrite(struct ssd1963 *lcd, char val)
 {
+	lcd->stats.bus_words++;
+	if (BUS_MOCK())
+	{
+		BusModelCmd(lcd, val);
+		return;
+	}
 	CMD_ENA();									// assert command mode
 	WR_ENA();									// assert write
 	//LL_GPIO_WriteOutputPort(GPIOB, val);		// put Val[7:0] on DB[7:0]
-    DataWriteLower(val);
+    DataWriteLower(lcd, val);
 	WR_DIS();									// deassert write to latch data
+	if (lcd->loopback)
+		LoopbackSample(lcd);
 	DATA_ENA();									// assert data mode
 }
 
-#define DATA_ORIG       0
-#define DATA_ARRAY      1
-#define DATA_WRITEL     0
-#define DATA_POINTER    0
+// Read one byte from DB[7:0] in data mode, used for controller status only
+static unsigned int DataRead(struct ssd1963 *lcd)
+{
+    unsigned int val = 0, i = 0;
 
-#if (!GPIO_ORIG && !DATA_ORIG)
-    #error Must choose either GPIO_ORIG or DATA_ORIG!
-#endif
+    if(BUS_MOCK())
+        return BusModelRead(lcd);
 
-#if DATA_ARRAY
-struct gpio_descs *gpio_os;
-#endif
+    // All of DB[15:0] is released, the host must not drive the upper byte
+    // against the controller while /RD is asserted
+    for(i = 0; i < LCD_DATA_PINS; i++)
+        gpiod_direction_input(lcd->gpio_data->desc[i]);
+
+    RD_ENA();                                   // assert read, controller drives DB
+    ndelay(250);                                // tRDL + data access time, with margin
+    for(i = 0; i < 8; i++)
+        val |= (GPIO_GET(lcd->gpio_data->desc[i]) ? 1 : 0) << i;
+    RD_DIS();                                   // deassert read
+
+    for(i = 0; i < LCD_DATA_PINS; i++)
+        gpiod_direction_output_raw(lcd->gpio_data->desc[i], 0);
+
+    return val;
+}
+
+//############################# bus backends ##############################
+// Ways to put a data word on DB[15:0] and strobe /WR. All of them are built
+// in; BusBackendTune() times the viable ones at probe and keeps the fastest,
+// sysfs bus_backend overrides the choice. writel and pointer write the GPIO
+// bank register given by solomon,data-reg directly, with DB[15:0] in bits
+// 0-15 and /WR in bit 17, bypassing gpiolib.
+//#########################################################################
 
-static void DataWrite(unsigned int val)
+#define DATA_REG_WR     BIT(17)
+
+static void DataWriteOrig(struct ssd1963 *lcd, unsigned int val)
 {
-#if DATA_ORIG
     // Data mode is the default, no need to enable it
 	WR_ENA();       // assert write
     //GPIOC->ODR = val >> 8;						// put Val[15:8] on DB[15:8]
-    DataWriteUpper(val >> 8);
+    DataWriteUpper(lcd, val >> 8);
     //GPIOB->ODR = val;							// put Val[7:0] on DB[7:0]
-    DataWriteLower(val);
+    DataWriteLower(lcd, val);
     // Stay in data mode (default)
     WR_DIS();	
-#elif DATA_ARRAY
-    unsigned int os[16];
+}
+
+// gpiod_set_array_value() takes a bitmap and the array info since 4.19
+static void DataWriteArray(struct ssd1963 *lcd, unsigned int val)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+    unsigned long os = val & 0xFFFF;
+#else
+    int os[16];
     unsigned int i;
+#endif
     
     WR_ENA();       // assert write
-    if(gpio_os)
+    if(lcd->gpio_data)
     {
+        lcd->stats.gpio_calls++;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+        if(lcd->gpio_cansleep)
+            gpiod_set_array_value_cansleep(16, lcd->gpio_data->desc, lcd->gpio_data->info, &os);
+        else
+            gpiod_set_array_value(16, lcd->gpio_data->desc, lcd->gpio_data->info, &os);
+#else
         for(i=0;i<16;i++)
         {
             os[i] = (val >> i) & 0x1;
         }
-        gpiod_set_array_value(16, gpio_os->desc, os);
+        if(lcd->gpio_cansleep)
+            gpiod_set_array_value_cansleep(16, lcd->gpio_data->desc, os);
+        else
+            gpiod_set_array_value(16, lcd->gpio_data->desc, os);
+#endif
     }
     WR_DIS();	
-#elif DATA_WRITEL
-    void __iomem *GPIO4_BADDR = 0x3023000;
-    GPIO4_BADDR = ioremap(0x3023000, 1);
-    u32 reg = readl(GPIO4_BADDR) & (~0x20000);
+}
 
-    writel(reg, GPIO4_BADDR);    // assert write
-    reg &= 0xFFFF0000;
-    reg |= val & 0xFFFF;
-    writel(reg, GPIO4_BADDR);
-    reg |= 0x20000;
-    writel(reg, GPIO4_BADDR);    // deassert write to latch data
-    
-    iounmap(0x3023000);
-#elif DATA_POINTER
-    volatile u32 *GPIO4_BADDR = 0x3023000;
-    //GPIO4_BADDR = ioremap(0x3023000, 1);
-    u32 reg = *GPIO4_BADDR & (~0x20000);
+static void StrobeGpio(struct ssd1963 *lcd)
+{
+    WR_ENA();
+    WR_DIS();
+}
+
+static void DataWriteWritel(struct ssd1963 *lcd, unsigned int val)
+{
+    u32 reg = readl(lcd->data_reg) & ~DATA_REG_WR;
 
-    *GPIO4_BADDR = reg;     // assert write
+    writel(reg, lcd->data_reg);                 // assert write
     reg &= 0xFFFF0000;
     reg |= val & 0xFFFF;
-    *GPIO4_BADDR = reg;     //set GPIOs
-    reg |= 0x20000;
-    *GPIO4_BADDR = reg;     // deassert write to latch data
-    //iounmap(0x3023000);
-#endif
+    writel(reg, lcd->data_reg);                 // set DB[15:0]
+    writel(reg | DATA_REG_WR, lcd->data_reg);   // deassert write to latch data
 }
 
-//#####################################################################################################
+static void StrobeWritel(struct ssd1963 *lcd)
+{
+    u32 reg = readl(lcd->data_reg);
 
-struct ssd1963 {
-	struct device *dev;
-	//volatile unsigned short *ctrl_io;
-	//volatile unsigned short *data_io;
-	//struct fb_info *info;
-	//unsigned int pages_count;
-	//struct ssd1963_page *pages;
-	//nsigned long pseudo_palette[25];
-};
+    writel(reg & ~DATA_REG_WR, lcd->data_reg);
+    writel(reg | DATA_REG_WR, lcd->data_reg);
+}
 
+// writel without the barriers
+static void DataWritePointer(struct ssd1963 *lcd, unsigned int val)
+{
+    u32 reg = __raw_readl(lcd->data_reg) & ~DATA_REG_WR;
 
+    __raw_writel(reg, lcd->data_reg);           // assert write
+    reg &= 0xFFFF0000;
+    reg |= val & 0xFFFF;
+    __raw_writel(reg, lcd->data_reg);           // set DB[15:0]
+    __raw_writel(reg | DATA_REG_WR, lcd->data_reg);
+}
 
-static void ssd1963_update_all()
+static void StrobePointer(struct ssd1963 *lcd)
 {
-	p_updates++;    
+    u32 reg = __raw_readl(lcd->data_reg);
 
-    schedule_delayed_work(&ssd1963_work, SSD1963_PERIOD);
+    __raw_writel(reg & ~DATA_REG_WR, lcd->data_reg);
+    __raw_writel(reg | DATA_REG_WR, lcd->data_reg);
 }
 
-static void ssd1963_update(struct work_struct *unused)
+static void DataWriteMock(struct ssd1963 *lcd, unsigned int val)
 {
-    p_updates++;
+    BusModelData(lcd, val);
+}
 
-    if(p_img == 2)
+static const struct bus_backend {
+    const char *name;
+    void (*write)(struct ssd1963 *lcd, unsigned int val);   // one word with its /WR strobe
+    void (*strobe)(struct ssd1963 *lcd);                    // /WR strobe, DB[15:0] unchanged
+} bus_backends[BUS_BACKEND_COUNT] = {
+    [BUS_BACKEND_ORIG]      = { "orig", DataWriteOrig, StrobeGpio },
+    [BUS_BACKEND_ARRAY]     = { "array", DataWriteArray, StrobeGpio },
+    [BUS_BACKEND_WRITEL]    = { "writel", DataWriteWritel, StrobeWritel },
+    [BUS_BACKEND_POINTER]   = { "pointer", DataWritePointer, StrobePointer },
+    [BUS_BACKEND_MOCK]      = { "mock", DataWriteMock, NULL },
+};
+
+// Backend a word goes through now, the model while the bus is mocked
+#define BUS_BACKEND(lcd)    (BUS_MOCK() ? BUS_BACKEND_MOCK : (lcd)->backend)
+
+static bool BusBackendViable(struct ssd1963 *lcd, int backend)
+{
+    switch (backend)
     {
-        //pull image data from frame buffer
-        if(framebuffer)
+    case BUS_BACKEND_ORIG:
+    case BUS_BACKEND_ARRAY:
+        return lcd->gpio_data != NULL;
+    case BUS_BACKEND_WRITEL:
+    case BUS_BACKEND_POINTER:
+        return lcd->data_reg != NULL;
+    default:
+        return false;
+    }
+}
+
+static void DataWrite(struct ssd1963 *lcd, unsigned int val)
+{
+    lcd->stats.bus_words++;
+    if(BUS_MOCK())
+    {
+        // The shadow follows the model now, not the glass
+        lcd->ShadowExact = false;
+        BusModelData(lcd, val);
+        return;
+    }
+    bus_backends[lcd->backend].write(lcd, val);
+    if(lcd->loopback)
+        LoopbackSample(lcd);
+}
+
+// Write the same word count times. The data lines are set once and only the
+// write strobe toggles for the repeats.
+static void DataRepeat(struct ssd1963 *lcd, unsigned int val, unsigned int count)
+{
+    if(!count)
+        return;
+    DataWrite(lcd, val);
+    count--;
+    if(!BUS_MOCK())
+    {
+        lcd->stats.bus_words += count;
+        while(count--)
+        {
+            bus_backends[lcd->backend].strobe(lcd);
+            if(lcd->loopback)
+                LoopbackSample(lcd);
+        }
+        return;
+    }
+    while(count--)
+        DataWrite(lcd, val);
+}
+
+#define BUS_TUNE_WORDS      4096
+
+// Time every viable backend writing to a 1x1 window at (0,0) and keep the
+// fastest, with bus_lock held. The pixel alternates and ends with its shadow
+// value, sprites over it are composed again by the next update. Without a shadow buffer the
+// pixel cannot be restored and nothing is timed. With the bus mocked only the
+// model is timed.
+static bool BusBackendTune(struct ssd1963 *lcd)
+{
+    struct ssd1963_stats saved;
+    u16 pixel;
+    int backend, first, last, best = lcd->backend, n;
+    u64 start, ns;
+
+    if (!lcd->ShadowBuffer)
+        return false;
+    saved = lcd->stats;
+    pixel = lcd->ShadowBuffer[0];
+
+    first = BUS_MOCK() ? BUS_BACKEND_MOCK : 0;
+    last = BUS_MOCK() ? BUS_BACKEND_MOCK : BUS_BACKEND_MOCK - 1;
+    for (backend = first; backend <= last; backend++)
+    {
+        lcd->bus_rate[backend] = 0;
+        if (backend != BUS_BACKEND_MOCK && !BusBackendViable(lcd, backend))
+            continue;
+        if (backend != BUS_BACKEND_MOCK)
+            lcd->backend = backend;
+
+        WindowSet(lcd, 0, 0, 0, 0);
+        start = ktime_get_ns();
+        for (n = 0; n < BUS_TUNE_WORDS; n++)
+            DataWrite(lcd, (n & 1) ? pixel : (u16)~pixel);
+        ns = max_t(u64, ktime_get_ns() - start, 1);
+        lcd->bus_rate[backend] = div64_u64((u64)BUS_TUNE_WORDS * NSEC_PER_SEC, ns);
+
+        if (backend != BUS_BACKEND_MOCK && lcd->bus_rate[backend] > lcd->bus_rate[best])
+            best = backend;
+    }
+    if (!BUS_MOCK())
+        lcd->backend = best;
+    lcd->stats = saved;
+    SpriteDamage(lcd, 0, 0, 0, 0);
+    return true;
+}
+
+//############################### capture #################################
+// Every request entering the driver can be logged with its panel, rectangle,
+// time and pixel hash or payload. The log of all panels is a byte FIFO read
+// (blocking) from debugfs ssd1963/capture; records that do not fit are
+// dropped and counted.
+//#########################################################################
+
+static DEFINE_MUTEX(capture_lock);
+static DECLARE_WAIT_QUEUE_HEAD(capture_wait);
+static struct kfifo capture_fifo;
+static bool capture_ready;
+static u64 capture_dropped;
+
+// Hash data of rows rows of rowBytes bytes, stride bytes apart, into the
+// record and log it, with the data as payload in capture mode 2. data is NULL
+// for requests without pixels.
+static void capture_log(struct ssd1963 *lcd, u16 type, int col, int row, int width, int height, u32 id, u32 arg,
+                        const char *data, int rows, int rowBytes, int stride)
+{
+    struct ssd1963_capture_record rec = {
+        .magic = SSD1963_CAPTURE_MAGIC,
+        .type = type,
+        .panel = lcd->index,
+        .timestamp_ns = ktime_get_ns(),
+        .col = col,
+        .row = row,
+        .width = width,
+        .height = height,
+        .id = id,
+        .arg = arg,
+    };
+    int mode = READ_ONCE(p_capture);
+    int r;
+
+    if (mode <= 0)
+        return;
+
+    mutex_lock(&capture_lock);
+    if (!capture_ready)
+    {
+        if (kfifo_alloc(&capture_fifo, (size_t)max(p_captureBuffer, 4) * 1024, GFP_KERNEL))
+        {
+            mutex_unlock(&capture_lock);
+            return;
+        }
+        capture_ready = true;
+    }
+
+    if (data)
+    {
+        rec.hash = ~0;
+        for (r = 0; r < rows; r++)
+            rec.hash = crc32_le(rec.hash, data + (r * stride), rowBytes);
+        rec.hash = ~rec.hash;
+        if (mode >= 2)
+            rec.length = rows * rowBytes;
+    }
+
+    if (kfifo_avail(&capture_fifo) < sizeof(rec) + rec.length)
+    {
+        capture_dropped++;
+        mutex_unlock(&capture_lock);
+        return;
+    }
+    kfifo_in(&capture_fifo, &rec, sizeof(rec));
+    for (r = 0; rec.length && r < rows; r++)
+        kfifo_in(&capture_fifo, data + (r * stride), rowBytes);
+    mutex_unlock(&capture_lock);
+
+    wake_up_interruptible(&capture_wait);
+}
+
+// pixels points at the first pixel of a width x height rectangle whose rows
+// are stride bytes apart, or is NULL for requests without pixels
+static void capture_record(struct ssd1963 *lcd, u16 type, int col, int row, int width, int height, u32 id, u32 arg,
+                           const char *pixels, int stride)
+{
+    capture_log(lcd, type, col, row, width, height, id, arg, pixels, height, width * 2, stride);
+}
+
+// Request carrying length bytes that are not RGB565 pixels (compressed data)
+static void capture_record_bytes(struct ssd1963 *lcd, u16 type, int col, int row, int width, int height, u32 id,
+                                 u32 arg, const void *data, u32 length)
+{
+    capture_log(lcd, type, col, row, width, height, id, arg, data, 1, length, length);
+}
+
+static ssize_t capture_read(struct file *file, char __user *buf, size_t len, loff_t *off)
+{
+    unsigned int copied;
+    int ret;
+
+    do
+    {
+        mutex_lock(&capture_lock);
+        if (capture_ready && !kfifo_is_empty(&capture_fifo))
+        {
+            ret = kfifo_to_user(&capture_fifo, buf, len, &copied);
+            mutex_unlock(&capture_lock);
+            return ret ? ret : copied;
+        }
+        mutex_unlock(&capture_lock);
+
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        ret = wait_event_interruptible(capture_wait,
+                                       READ_ONCE(capture_ready) && !kfifo_is_empty(&capture_fifo));
+    } while (ret == 0);
+
+    return ret;
+}
+
+static const struct file_operations capture_fops = {
+    .owner = THIS_MODULE,
+    .read = capture_read,
+    .llseek = noop_llseek,
+};
+
+static void capture_exit(void)
+{
+    if (capture_ready)
+        kfifo_free(&capture_fifo);
+}
+
+//############################ image cache ################################
+// Full-screen images are uploaded once through SSD1963_IOC_CACHE_UPLOAD and
+// displayed by ID afterwards, so switching screens costs no user copy. The
+// images built into the driver are registered as pinned entries so the
+// "image" module parameter goes through the same lookup. Every panel has its
+// own cache, the built-in images are shared.
+//#########################################################################
+
+struct img_cache_entry {
+    struct list_head lru;
+    u32 id;
+    int width;
+    int height;
+    size_t size;
+    const char *data;
+};
+
+static struct img_cache_entry img_builtin[] = {
+    { .id = 1, .width = IMG_RES_HOR, .height = IMG_RES_VER, .data = Image3Array },     //splash image
+    { .id = 3, .width = IMG_RES_HOR, .height = IMG_RES_VER, .data = ImageArray },      //original sample image
+    { .id = 4, .width = IMG_RES_HOR, .height = IMG_RES_VER, .data = Image2Array },     //2nd sample image
+    { .id = 5, .width = IMG_RES_HOR, .height = IMG_RES_VER, .data = ClocktestImage },  //clock test image
+    { .id = 6, .width = IMG_RES_HOR, .height = IMG_RES_VER, .data = ColorbandsImage }, //color band test image
+    { .id = 7, .width = IMG_RES_HOR, .height = IMG_RES_VER, .data = GradientImage },   //gradient test image
+    { .id = 8, .width = IMG_RES_HOR, .height = IMG_RES_VER, .data = SharpnessImage },  //sharpness test image
+};
+
+static void img_cache_free(struct ssd1963 *lcd, struct img_cache_entry *entry)
+{
+    list_del(&entry->lru);
+    lcd->img_cache_used -= entry->size;
+    vfree(entry->data);
+    kfree(entry);
+}
+
+// Must be called with img_cache_lock held
+static struct img_cache_entry *img_cache_find(struct ssd1963 *lcd, u32 id)
+{
+    struct img_cache_entry *entry;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(img_builtin); i++)
+    {
+        if (img_builtin[i].id == id)
+            return &img_builtin[i];
+    }
+
+    list_for_each_entry(entry, &lcd->img_cache, lru)
+    {
+        if (entry->id == id)
+        {
+            list_move(&entry->lru, &lcd->img_cache);
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static int img_cache_upload(struct ssd1963 *lcd, const struct ssd1963_cache_upload *req)
+{
+    struct img_cache_entry *entry, *old;
+    // Sized in u64, width * height * 2 wraps a 32-bit size_t
+    u64 budget = (u64)max(p_cacheBudget, 0) * 1024;
+    u64 bytes = (u64)req->width * req->height * 2;
+    size_t size;
+    char *data;
+
+    if (req->id < SSD1963_CACHE_ID_USER_MIN || bytes == 0)
+        return -EINVAL;
+    if (bytes > budget || bytes > SIZE_MAX)
+        return -ENOSPC;
+    size = bytes;
+
+    entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+    data = vmalloc(size);
+    if (!entry || !data)
+    {
+        kfree(entry);
+        vfree(data);
+        return -ENOMEM;
+    }
+
+    // Copy outside of the lock, the display worker may be reading the cache
+    if (copy_from_user(data, u64_to_user_ptr(req->data), size))
+    {
+        kfree(entry);
+        vfree(data);
+        return -EFAULT;
+    }
+    capture_record(lcd, SSD1963_CAPTURE_UPLOAD, 0, 0, req->width, req->height, req->id, 0,
+                   data, req->width * 2);
+
+    entry->id = req->id;
+    entry->width = req->width;
+    entry->height = req->height;
+    entry->size = size;
+    entry->data = data;
+
+    mutex_lock(&lcd->img_cache_lock);
+    old = img_cache_find(lcd, req->id);
+    if (old)
+        img_cache_free(lcd, old);
+
+    // Evict least recently used images until the new one fits
+    while (lcd->img_cache_used + size > budget && !list_empty(&lcd->img_cache))
+        img_cache_free(lcd, list_last_entry(&lcd->img_cache, struct img_cache_entry, lru));
+
+    list_add(&entry->lru, &lcd->img_cache);
+    lcd->img_cache_used += size;
+    mutex_unlock(&lcd->img_cache_lock);
+
+    return 0;
+}
+
+static int img_cache_drop(struct ssd1963 *lcd, u32 id)
+{
+    struct img_cache_entry *entry;
+    int ret = -ENOENT;
+
+    if (id < SSD1963_CACHE_ID_USER_MIN)
+        return -EINVAL;
+
+    mutex_lock(&lcd->img_cache_lock);
+    entry = img_cache_find(lcd, id);
+    if (entry)
+    {
+        img_cache_free(lcd, entry);
+        ret = 0;
+    }
+    mutex_unlock(&lcd->img_cache_lock);
+
+    return ret;
+}
+
+static void img_cache_clear(struct ssd1963 *lcd)
+{
+    struct img_cache_entry *entry, *tmp;
+
+    mutex_lock(&lcd->img_cache_lock);
+    list_for_each_entry_safe(entry, tmp, &lcd->img_cache, lru)
+        img_cache_free(lcd, entry);
+    mutex_unlock(&lcd->img_cache_lock);
+}
+
+// Returns false if the ID is not in the cache
+static bool img_cache_show(struct ssd1963 *lcd, u32 id, int col, int row)
+{
+    struct img_cache_entry *entry;
+
+    // The lock is held for the transfer so the entry cannot be evicted under us
+    mutex_lock(&lcd->img_cache_lock);
+    entry = img_cache_find(lcd, id);
+    if (entry)
+        DispRectCopy(lcd, col, row, entry->width, entry->height, entry->data);
+    mutex_unlock(&lcd->img_cache_lock);
+
+    return entry != NULL;
+}
+
+static int img_cache_request_show(struct ssd1963 *lcd, const struct ssd1963_cache_show *req)
+{
+    struct img_cache_entry *entry;
+
+    mutex_lock(&lcd->img_cache_lock);
+    entry = img_cache_find(lcd, req->id);
+    if (!entry)
+    {
+        mutex_unlock(&lcd->img_cache_lock);
+        return -ENOENT;
+    }
+    if (lcd->img_show_pending)
+        lcd->stats.merged++;
+    lcd->img_show = *req;
+    trace_ssd1963_submit("cache", req->col, req->row, entry->width, entry->height);
+    capture_record(lcd, SSD1963_CAPTURE_SHOW, req->col, req->row, 0, 0, req->id, 0, NULL, 0);
+    lcd->img_show_pending = true;
+    mutex_unlock(&lcd->img_cache_lock);
+
+    ssd1963_kick(lcd);
+
+    return 0;
+}
+
+//############################### sprites #################################
+// Small colour-keyed sprites (cursors, indicators) drawn over the background.
+// Moving a sprite only re-sends its old and new bounding boxes, composed from
+// ShadowBuffer and the other visible sprites.
+//#########################################################################
+
+static bool sprite_overlaps(int col, int row, int width, int height,
+                            int StartPosX, int EndPosX, int StartPosY, int EndPosY)
+{
+    return (col <= EndPosX) && (col + width - 1 >= StartPosX) &&
+           (row <= EndPosY) && (row + height - 1 >= StartPosY);
+}
+
+// Called by the render functions after the background changed under a rectangle
+static void SpriteDamage(struct ssd1963 *lcd, int StartPosX, int EndPosX, int StartPosY, int EndPosY)
+{
+    int i;
+
+    mutex_lock(&lcd->sprite_lock);
+    for (i = 0; i < SSD1963_SPRITE_MAX; i++)
+    {
+        if (lcd->sprites[i].drawn &&
+            sprite_overlaps(lcd->sprites[i].drawnCol, lcd->sprites[i].drawnRow,
+                            lcd->sprites[i].drawnWidth, lcd->sprites[i].drawnHeight,
+                            StartPosX, EndPosX, StartPosY, EndPosY))
+            lcd->sprites[i].dirty = true;
+    }
+    mutex_unlock(&lcd->sprite_lock);
+}
+
+// Compose the background and all visible sprites over a rectangle of at most
+// SSD1963_SPRITE_MAX_DIM square and send it. Must be called with sprite_lock held.
+static void sprite_rect_send(struct ssd1963 *lcd, int PosX, int PosY, int Width, int Height)
+{
+    int StartPosX = max(PosX, DISP_COL_MIN);
+    int EndPosX = min(PosX + Width - 1, DISP_COL_MAX);
+    int StartPosY = max(PosY, DISP_ROW_MIN);
+    int EndPosY = min(PosY + Height - 1, DISP_ROW_MAX);
+    int RectWidth = EndPosX - StartPosX + 1;
+    int Row, Col, i;
+    u16 *Dst;
+
+    if ((EndPosX < StartPosX) || (EndPosY < StartPosY))
+        return;
+
+    for (Row = StartPosY; Row <= EndPosY; Row++)
+    {
+        Dst = lcd->sprite_scratch + ((Row - StartPosY) * RectWidth);
+        if (lcd->ShadowBuffer)
+            memcpy(Dst, lcd->ShadowBuffer + (Row * DISP_RES_HOR) + StartPosX, RectWidth * 2);
+        else
+            memset(Dst, 0, RectWidth * 2);
+    }
+
+    for (i = 0; i < SSD1963_SPRITE_MAX; i++)
+    {
+        const struct sprite *spr = &lcd->sprites[i];
+
+        if (!spr->used || !spr->visible ||
+            !sprite_overlaps(spr->col, spr->row, spr->width, spr->height,
+                             StartPosX, EndPosX, StartPosY, EndPosY))
+            continue;
+
+        for (Row = max(StartPosY, spr->row); Row <= min(EndPosY, spr->row + spr->height - 1); Row++)
+        {
+            for (Col = max(StartPosX, spr->col); Col <= min(EndPosX, spr->col + spr->width - 1); Col++)
+            {
+                u16 Pixel = spr->pixels[((Row - spr->row) * spr->width) + (Col - spr->col)];
+
+                if (Pixel != spr->colorkey)
+                    lcd->sprite_scratch[((Row - StartPosY) * RectWidth) + (Col - StartPosX)] = Pixel;
+            }
+        }
+    }
+
+    DispRectWrite(lcd, StartPosX, EndPosX, StartPosY, EndPosY, lcd->sprite_scratch);
+}
+
+// Redraw the sprites that moved or had their background redrawn
+static void sprite_flush(struct ssd1963 *lcd)
+{
+    struct sprite *spr;
+    int i;
+
+    mutex_lock(&lcd->sprite_lock);
+    for (i = 0; i < SSD1963_SPRITE_MAX; i++)
+    {
+        spr = &lcd->sprites[i];
+        if (!spr->dirty)
+            continue;
+        trace_ssd1963_dequeue("sprite", spr->col, spr->row, spr->width, spr->height);
+
+        // Old bounding box, unless the new one covers exactly the same pixels
+        if (spr->drawn &&
+            (!spr->visible || spr->drawnCol != spr->col || spr->drawnRow != spr->row ||
+             spr->drawnWidth != spr->width || spr->drawnHeight != spr->height))
+            sprite_rect_send(lcd, spr->drawnCol, spr->drawnRow, spr->drawnWidth, spr->drawnHeight);
+        // New bounding box
+        if (spr->visible)
+            sprite_rect_send(lcd, spr->col, spr->row, spr->width, spr->height);
+
+        spr->drawn = spr->visible;
+        spr->drawnCol = spr->col;
+        spr->drawnRow = spr->row;
+        spr->drawnWidth = spr->width;
+        spr->drawnHeight = spr->height;
+        spr->dirty = false;
+    }
+    mutex_unlock(&lcd->sprite_lock);
+}
+
+static int sprite_register(struct ssd1963 *lcd, const struct ssd1963_sprite_register *req)
+{
+    struct sprite *spr;
+    size_t count = (size_t)req->width * req->height;
+    u16 *pixels;
+    bool erase;
+    int i;
+
+    if (req->id >= SSD1963_SPRITE_MAX || count == 0 ||
+        req->width > SSD1963_SPRITE_MAX_DIM || req->height > SSD1963_SPRITE_MAX_DIM)
+        return -EINVAL;
+
+    pixels = kmalloc_array(count, sizeof(u16), GFP_KERNEL);
+    if (!pixels)
+        return -ENOMEM;
+    if (copy_from_user(pixels, u64_to_user_ptr(req->data), count * 2))
+    {
+        kfree(pixels);
+        return -EFAULT;
+    }
+    capture_record(lcd, SSD1963_CAPTURE_SPRITE, 0, 0, req->width, req->height, req->id, req->colorkey,
+                   (const char *)pixels, req->width * 2);
+    for (i = 0; i < count; i++)
+        pixels[i] = le16_to_cpu((__force __le16)pixels[i]);
+
+    mutex_lock(&lcd->sprite_lock);
+    spr = &lcd->sprites[req->id];
+    kfree(spr->pixels);
+    spr->pixels = pixels;
+    spr->width = req->width;
+    spr->height = req->height;
+    spr->colorkey = req->colorkey;
+    spr->visible = false;
+    spr->used = true;
+    spr->dirty = erase = spr->drawn;    //erase the old sprite on the next update
+    mutex_unlock(&lcd->sprite_lock);
+
+    if (erase)
+        ssd1963_kick(lcd);
+
+    return 0;
+}
+
+static int sprite_move(struct ssd1963 *lcd, const struct ssd1963_sprite_move *req)
+{
+    struct sprite *spr;
+
+    if (req->id >= SSD1963_SPRITE_MAX)
+        return -EINVAL;
+
+    mutex_lock(&lcd->sprite_lock);
+    spr = &lcd->sprites[req->id];
+    if (!spr->used)
+    {
+        mutex_unlock(&lcd->sprite_lock);
+        return -ENOENT;
+    }
+    spr->col = req->col;
+    spr->row = req->row;
+    spr->visible = !!req->visible;
+    spr->dirty = true;
+    trace_ssd1963_submit("sprite", spr->col, spr->row, spr->width, spr->height);
+    capture_record(lcd, SSD1963_CAPTURE_MOVE, req->col, req->row, 0, 0, req->id, spr->visible, NULL, 0);
+    mutex_unlock(&lcd->sprite_lock);
+
+    ssd1963_kick(lcd);
+
+    return 0;
+}
+
+static void sprite_clear(struct ssd1963 *lcd)
+{
+    int i;
+
+    mutex_lock(&lcd->sprite_lock);
+    for (i = 0; i < SSD1963_SPRITE_MAX; i++)
+    {
+        kfree(lcd->sprites[i].pixels);
+        memset(&lcd->sprites[i], 0, sizeof(lcd->sprites[i]));
+    }
+    mutex_unlock(&lcd->sprite_lock);
+}
+
+//############################### selftest ################################
+// Reading ssd1963/panel<n>/selftest runs the render primitives of that panel
+// against the bus model: pixel-exact checks of full, partial and off-screen
+// rendering for every font and built-in image, then bus words and ns/pixel per
+// primitive. The update worker is held off by bus_lock and the driver state is
+// restored afterwards; the other panels keep running on their bus.
+//#########################################################################
+
+#define SELFTEST_SENTINEL   0x1234      //pixels outside the rendered rectangle
+
+struct selftest {
+    struct ssd1963 *lcd;
+    struct seq_file *m;
+    int passed;
+    int failed;
+    char *src;                          //DISP_PIX_TOT * 2 byte pattern
+    int char_x;                         //character under test
+    int char_y;
+    char ch;
+};
+
+static void selftest_reset(struct ssd1963 *lcd)
+{
+    int i;
+
+    for (i = 0; i < DISP_PIX_TOT; i++)
+        lcd->bus_model.mem[i] = SELFTEST_SENTINEL;
+}
+
+static void selftest_result(struct selftest *t, bool ok, const char *what, int x, int y)
+{
+    if (ok)
+    {
+        t->passed++;
+        return;
+    }
+    t->failed++;
+    seq_printf(t->m, "FAIL %s at %d,%d\n", what, x, y);
+}
+
+// Clipped window of a rectangle, false if it is completely off-screen
+static bool selftest_clip(struct ssd1963 *lcd, int x, int y, int w, int h, int *sx, int *ex, int *sy, int *ey)
+{
+    *sx = max(x, DISP_COL_MIN);
+    *ex = min(x + w - 1, DISP_COL_MAX);
+    *sy = max(y, DISP_ROW_MIN);
+    *ey = min(y + h - 1, DISP_ROW_MAX);
+    return (*sx <= *ex) && (*sy <= *ey);
+}
+
+static int selftest_expect_ret(struct ssd1963 *lcd, int x, int y, int w, int h)
+{
+    int sx, ex, sy, ey;
+
+    if (!selftest_clip(lcd, x, y, w, h, &sx, &ex, &sy, &ey))
+        return DISP_RENDER_RESULT_NONE;
+    if ((ex - sx + 1) * (ey - sy + 1) < w * h)
+        return DISP_RENDER_RESULT_PART;
+    return DISP_RENDER_RESULT_FULL;
+}
+
+// Compare the whole model against expect(), which returns the pixel for a
+// position inside the clipped window of the unclipped rectangle x, y, w
+static void selftest_verify(struct selftest *t, const char *what, int x, int y, int w, int h,
+                            u16 (*expect)(struct selftest *t, int col, int row, int x, int y, int w),
+                            int ret)
+{
+    int sx, ex, sy, ey, col, row;
+    struct ssd1963 *lcd = t->lcd;
+    bool in, visible;
+
+    selftest_result(t, ret == selftest_expect_ret(lcd, x, y, w, h), what, x, y);
+    visible = selftest_clip(lcd, x, y, w, h, &sx, &ex, &sy, &ey);
+
+    for (row = DISP_ROW_MIN; row <= DISP_ROW_MAX; row++)
+    {
+        for (col = DISP_COL_MIN; col <= DISP_COL_MAX; col++)
+        {
+            u16 got = lcd->bus_model.mem[(row * DISP_RES_HOR) + col];
+            u16 want = SELFTEST_SENTINEL;
+
+            in = visible && col >= sx && col <= ex && row >= sy && row <= ey;
+            if (in)
+                want = expect(t, col, row, x, y, w);
+            if (got != want)
+            {
+                selftest_result(t, false, what, col, row);
+                return;
+            }
+        }
+    }
+    selftest_result(t, true, what, x, y);
+}
+
+static u16 selftest_expect_fill(struct selftest *t, int col, int row, int x, int y, int w)
+{
+    return DISP_MAG_MAX;
+}
+
+// Each visible pixel shows the source pixel at its place in the unclipped
+// rectangle, the clipped cases catch a source that is not skipped with the
+// clipped rows and columns
+static u16 selftest_expect_copy(struct selftest *t, int col, int row, int x, int y, int w)
+{
+    const u8 *b = (const u8 *)t->src + ((((row - y) * w) + (col - x)) * 2);
+
+    return (b[1] << 8) | b[0];
+}
+
+static u16 selftest_expect_char(struct selftest *t, int col, int row, int x, int y, int w)
+{
+    struct ssd1963 *lcd = t->lcd;
+    int rowBytes = (lcd->CurFontStruct.Width / 8) + 1;
+    int c = col - t->char_x;
+    int r = row - t->char_y;
+    const u8 *glyph = (const u8 *)lcd->CurFontStruct.table +
+                      ((t->ch - 0x20) * lcd->CurFontStruct.Height * rowBytes);
+
+    return (glyph[(r * rowBytes) + (c / 8)] & (0x80 >> (c % 8))) ? DISP_WHT_MAX : DISP_BLU_MAX;
+}
+
+static void selftest_rects(struct selftest *t)
+{
+    struct ssd1963 *lcd = t->lcd;
+    static const struct { int dx, dy, w, h; bool right, bottom; } cases[] = {
+        { 10, 20, 30, 40, false, false },   //full
+        { -5, -7, 20, 20, false, false },   //clipped top left
+        { -9, -9, 20, 20, true,  true  },   //clipped bottom right
+        { 1,  0,  10, 10, true,  false },   //off the right edge
+        { -20, -20, 10, 10, false, false }, //off the top left
+        { 0,  0,  0,  0,  false, false },   //whole screen, see below
+    };
+    int i, x, y, w, h;
+
+    for (i = 0; i < ARRAY_SIZE(cases); i++)
+    {
+        x = cases[i].right ? DISP_COL_MAX + cases[i].dx + 1 : cases[i].dx;
+        y = cases[i].bottom ? DISP_ROW_MAX + cases[i].dy + 1 : cases[i].dy;
+        w = cases[i].w ? cases[i].w : DISP_RES_HOR;
+        h = cases[i].h ? cases[i].h : DISP_RES_VER;
+
+        selftest_reset(lcd);
+        DispForeColorSet(lcd, DISP_MAG_MAX);
+        selftest_verify(t, "fill", x, y, w, h, selftest_expect_fill,
+                        DispFilledRectRender(lcd, x, y, w, h));
+
+        selftest_reset(lcd);
+        selftest_verify(t, "copy", x, y, w, h, selftest_expect_copy,
+                        DispRectCopy(lcd, x, y, w, h, t->src));
+    }
+}
+
+static void selftest_chars(struct selftest *t)
+{
+    struct ssd1963 *lcd = t->lcd;
+    static const char chars[] = { 'A', 'g', '~', 0x7f };
+    int font, i, pos;
+
+    DispForeColorSet(lcd, DISP_WHT_MAX);
+    DispBackColorSet(lcd, DISP_BLU_MAX);
+    for (font = DISP_FONT_8; font <= DISP_FONT_24; font++)
+    {
+        DispFontSet(lcd, font);
+        for (i = 0; i < ARRAY_SIZE(chars); i++)
+        {
+            for (pos = 0; pos < 3; pos++)
+            {
+                // fully visible, clipped by the right edge, off the bottom
+                t->char_x = (pos == 1) ? DISP_COL_MAX - (lcd->CurFontStruct.Width / 2) : 5;
+                t->char_y = (pos == 2) ? DISP_ROW_MAX + 1 : 5;
+                t->ch = chars[i];
+
+                selftest_reset(lcd);
+                selftest_verify(t, "char", t->char_x, t->char_y,
+                                lcd->CurFontStruct.Width, lcd->CurFontStruct.Height, selftest_expect_char,
+                                DispCharRender(lcd, t->char_x, t->char_y, t->ch));
+            }
+        }
+    }
+}
+
+static void selftest_images(struct selftest *t)
+{
+    struct ssd1963 *lcd = t->lcd;
+    char *src = t->src;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(img_builtin); i++)
+    {
+        selftest_reset(lcd);
+        // Only the clipped image is streamed, so compare it like a copy of the image
+        t->src = (char *)img_builtin[i].data;
+        img_cache_show(lcd, img_builtin[i].id, 0, 0);
+        selftest_verify(t, "image", 0, 0, img_builtin[i].width, img_builtin[i].height,
+                        selftest_expect_copy, selftest_expect_ret(lcd, 0, 0, img_builtin[i].width,
+                                                                  img_builtin[i].height));
+    }
+    t->src = src;
+}
+
+static void selftest_bench(struct selftest *t, const char *what, int which)
+{
+    struct ssd1963 *lcd = t->lcd;
+    const int loops = 8;
+    u64 words = lcd->stats.bus_words;
+    u64 pixels = lcd->stats.pixels;
+    u64 start = ktime_get_ns();
+    u64 ns;
+    int i, c;
+
+    for (i = 0; i < loops; i++)
+    {
+        switch (which)
+        {
+        case 0:
+            DispFilledRectRender(lcd, DISP_COL_MIN, DISP_ROW_MIN, DISP_RES_HOR, DISP_RES_VER);
+            break;
+        case 1:
+            DispRectCopy(lcd, DISP_COL_MIN, DISP_ROW_MIN, DISP_RES_HOR, DISP_RES_VER, t->src);
+            break;
+        case 2:
+            for (c = 0; c < DISP_RES_HOR / lcd->CurFontStruct.Width; c++)
+                DispCharRender(lcd, c * lcd->CurFontStruct.Width, 0, 'A' + (c % 26));
+            break;
+        }
+    }
+    ns = ktime_get_ns() - start;
+    pixels = lcd->stats.pixels - pixels;
+    words = lcd->stats.bus_words - words;
+
+    seq_printf(t->m, "bench %-5s %-6s pixels %llu bus words %llu ns/pixel %llu.%02llu\n",
+               what, bus_backends[BUS_BACKEND(lcd)].name, pixels, words,
+               pixels ? div64_u64(ns, pixels) : 0,
+               pixels ? div64_u64((ns * 100), pixels) % 100 : 0);
+}
+
+// The renders above only run on the model, timing them on the panel would
+// change the glass. The real backends are timed on a single pixel by
+// BusBackendTune(), a copied pixel is one bus word.
+static void selftest_bench_backends(struct selftest *t)
+{
+    struct ssd1963 *lcd = t->lcd;
+    int i;
+
+    for (i = 0; i < BUS_BACKEND_MOCK; i++)
+    {
+        if (!lcd->bus_rate[i])
+            continue;
+        seq_printf(t->m, "bench word  %-6s ns/pixel %llu.%02llu (bus tuning)\n", bus_backends[i].name,
+                   div64_u64(NSEC_PER_SEC, lcd->bus_rate[i]),
+                   div64_u64(NSEC_PER_SEC * 100ULL, lcd->bus_rate[i]) % 100);
+    }
+}
+
+static int selftest_show(struct seq_file *m, void *v)
+{
+    struct ssd1963 *lcd = m->private;
+    struct selftest t = { .lcd = lcd, .m = m };
+    struct ssd1963_stats *saved_stats;
+    u16 *saved_shadow;
+    unsigned int fore, back;
+    int font, i;
+    bool exact;
+
+    saved_stats = kmalloc(sizeof(*saved_stats), GFP_KERNEL);
+    saved_shadow = vmalloc(DISP_PIX_TOT * sizeof(u16));
+    t.src = vmalloc(DISP_PIX_TOT * 2);
+    if (!saved_stats || !saved_shadow || !t.src || BusModelAlloc(lcd))
+    {
+        kfree(saved_stats);
+        vfree(saved_shadow);
+        vfree(t.src);
+        return -ENOMEM;
+    }
+    for (i = 0; i < DISP_PIX_TOT * 2; i++)
+        t.src[i] = (i * 7) + 1;
+
+    mutex_lock(&lcd->bus_lock);
+    *saved_stats = lcd->stats;
+    if (lcd->ShadowBuffer)
+        memcpy(saved_shadow, lcd->ShadowBuffer, DISP_PIX_TOT * sizeof(u16));
+    exact = lcd->ShadowExact;
+    fore = DispForeColorGet(lcd);
+    back = DispBackColorGet(lcd);
+    font = DispFontGet(lcd);
+    lcd->mock = true;
+
+    selftest_rects(&t);
+    selftest_chars(&t);
+    selftest_images(&t);
+    seq_printf(m, "%d passed, %d failed\n", t.passed, t.failed);
+
+    DispFontSet(lcd, DISP_FONT_24);
+    selftest_bench(&t, "fill", 0);
+    selftest_bench(&t, "copy", 1);
+    selftest_bench(&t, "char", 2);
+    selftest_bench_backends(&t);
+
+    DispForeColorSet(lcd, fore);
+    DispBackColorSet(lcd, back);
+    DispFontSet(lcd, font);
+    if (lcd->ShadowBuffer)
+        memcpy(lcd->ShadowBuffer, saved_shadow, DISP_PIX_TOT * sizeof(u16));
+    lcd->ShadowExact = exact;
+    lcd->stats = *saved_stats;
+    lcd->mock = false;
+    mutex_unlock(&lcd->bus_lock);
+
+    kfree(saved_stats);
+    vfree(saved_shadow);
+    vfree(t.src);
+    return 0;
+}
+
+static int selftest_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, selftest_show, inode->i_private);
+}
+
+static const struct file_operations selftest_fops = {
+    .owner = THIS_MODULE,
+    .open = selftest_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+// debugfs ssd1963/panel<n>/loopback: send the background in the shadow buffer
+// through the real GPIO path, decode the lines back into the bus model after
+// every strobe and compare. The glass does not change, the check refuses to
+// run until every pixel of the shadow is known (ShadowExact). Bound to gpio-sim
+// chips (see ssd1963-gpio-sim.dtso) this checks the command and data stream
+// and counts the gpiolib calls without a panel.
+static int loopback_show(struct seq_file *m, void *v)
+{
+    struct ssd1963 *lcd = m->private;
+    struct ssd1963_stats saved_stats;
+    u64 calls, errors, start, ns;
+    int i, bad = 0, first = -1;
+
+    if (!lcd->ShadowBuffer)
+    {
+        seq_puts(m, "no shadow buffer\n");
+        return 0;
+    }
+
+    mutex_lock(&lcd->bus_lock);
+    if (BUS_MOCK())
+    {
+        mutex_unlock(&lcd->bus_lock);
+        seq_puts(m, "busMock is set, the GPIOs are not driven\n");
+        return 0;
+    }
+    if (!lcd->ShadowExact)
+    {
+        // Redrawing would overwrite the unknown part of the glass
+        mutex_unlock(&lcd->bus_lock);
+        seq_puts(m, "shadow buffer not exact, draw a full frame first\n");
+        return 0;
+    }
+    if (BusModelAlloc(lcd))
+    {
+        mutex_unlock(&lcd->bus_lock);
+        return -ENOMEM;
+    }
+    for (i = 0; i < DISP_PIX_TOT; i++)
+        lcd->bus_model.mem[i] = ~lcd->ShadowBuffer[i];
+    lcd->bus_model.cmd = 0;
+
+    saved_stats = lcd->stats;
+    errors = lcd->loopback_errors;
+    lcd->loopback = true;
+    start = ktime_get_ns();
+    DispRectWrite(lcd, DISP_COL_MIN, DISP_COL_MAX, DISP_ROW_MIN, DISP_ROW_MAX, lcd->ShadowBuffer);
+    ns = ktime_get_ns() - start;
+    lcd->loopback = false;
+    calls = lcd->stats.gpio_calls - saved_stats.gpio_calls;
+    errors = lcd->loopback_errors - errors;
+    lcd->stats = saved_stats;
+
+    for (i = 0; i < DISP_PIX_TOT; i++)
+    {
+        if (lcd->bus_model.mem[i] == lcd->ShadowBuffer[i])
+            continue;
+        if (first < 0)
+            first = i;
+        bad++;
+    }
+
+    // The redraw covered the sprites
+    SpriteDamage(lcd, DISP_COL_MIN, DISP_COL_MAX, DISP_ROW_MIN, DISP_ROW_MAX);
+    sprite_flush(lcd);
+    mutex_unlock(&lcd->bus_lock);
+
+    if (bad)
+        seq_printf(m, "FAIL %d of %d pixels differ, first at (%d,%d)\n", bad, DISP_PIX_TOT,
+                   first % DISP_RES_HOR, first / DISP_RES_HOR);
+    else
+        seq_printf(m, "ok %d pixels\n", DISP_PIX_TOT);
+    seq_printf(m, "read errors: %llu\n", errors);
+    seq_printf(m, "gpio calls:  %llu (%llu.%02llu per pixel)\n", calls,
+               div64_u64(calls, DISP_PIX_TOT), div64_u64(calls * 100, DISP_PIX_TOT) % 100);
+    seq_printf(m, "frame:       %llu us (%s)\n", div_u64(ns, NSEC_PER_USEC), bus_backends[BUS_BACKEND(lcd)].name);
+
+    return 0;
+}
+
+static int loopback_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, loopback_show, inode->i_private);
+}
+
+static const struct file_operations loopback_fops = {
+    .owner = THIS_MODULE,
+    .open = loopback_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+//############################## statistics ###############################
+
+// Account one worker run that pushed pixels to the panel
+static void stats_record(struct ssd1963 *lcd, u64 ns, u64 pixels)
+{
+    int bucket = 0;
+    u64 us = div_u64(ns, NSEC_PER_USEC);
+
+    if (us)
+        bucket = min(ilog2(us) + 1, STATS_HIST_BUCKETS - 1);
+
+    lcd->stats.updates++;
+    lcd->stats.xfer_ns += ns;
+    lcd->stats.hist[bucket]++;
+    lcd->stats.backend_pixels[BUS_BACKEND(lcd)] += pixels;
+    lcd->stats.backend_ns[BUS_BACKEND(lcd)] += ns;
+}
+
+// Upper bound in us of the histogram bucket holding the given percentile
+static u64 stats_percentile(struct ssd1963 *lcd, int percent)
+{
+    u64 target = div_u64(lcd->stats.updates * percent + 99, 100);
+    u64 seen = 0;
+    int i;
+
+    for (i = 0; i < STATS_HIST_BUCKETS; i++)
+    {
+        seen += lcd->stats.hist[i];
+        if (seen >= target && seen)
+            return 1ULL << i;
+    }
+    return 0;
+}
+
+static int stats_show(struct seq_file *m, void *v)
+{
+    struct ssd1963 *lcd = m->private;
+    int i, depth = 0;
+
+    mutex_lock(&lcd->img_cache_lock);
+    depth += lcd->img_show_pending;
+    mutex_unlock(&lcd->img_cache_lock);
+    for (i = 0; i < SSD1963_PRIO_COUNT; i++)
+        depth += READ_ONCE(lcd->fb_damage_pending[i]);
+    depth += READ_ONCE(lcd->compressed_count);
+    mutex_lock(&lcd->sprite_lock);
+    for (i = 0; i < SSD1963_SPRITE_MAX; i++)
+        depth += lcd->sprites[i].dirty;
+    mutex_unlock(&lcd->sprite_lock);
+    if (lcd->index == 0)
+        depth += (READ_ONCE(p_img) != 0);
+    spin_lock(&lcd->stream_lock);
+    for (i = 0; i < lcd->stream.nbufs; i++)
+        depth += (lcd->stream_state[i] == STREAM_QUEUED);
+    spin_unlock(&lcd->stream_lock);
+
+    seq_printf(m, "updates:     %llu\n", lcd->stats.updates);
+    seq_printf(m, "pixels:      %llu\n", lcd->stats.pixels);
+    seq_printf(m, "bus_words:   %llu\n", lcd->stats.bus_words);
+    seq_printf(m, "gpio_calls:  %llu (%llu per update)\n", lcd->stats.gpio_calls,
+               lcd->stats.updates ? div64_u64(lcd->stats.gpio_calls, lcd->stats.updates) : 0);
+    seq_printf(m, "windows:     %llu\n", lcd->stats.windows);
+    seq_printf(m, "queue_depth: %d\n", depth);
+    seq_printf(m, "merged:      %llu\n", lcd->stats.merged);
+    seq_printf(m, "dropped:     %llu\n", lcd->stats.dropped);
+    seq_printf(m, "preempted:   %llu\n", lcd->stats.preempted);
+    seq_printf(m, "prep:        %llu stalls, %llu stripes (%llu pixels) skipped\n", lcd->stats.prep_stalls,
+               lcd->stats.prep_skipped, lcd->stats.prep_skipped_pixels);
+    seq_printf(m, "streamed:    %llu\n", lcd->stats.streamed);
+    seq_printf(m, "xfer_us:     p50 <%llu p90 <%llu p99 <%llu\n",
+               stats_percentile(lcd, 50), stats_percentile(lcd, 90), stats_percentile(lcd, 99));
+
+    seq_puts(m, "histogram (us):\n");
+    for (i = 0; i < STATS_HIST_BUCKETS; i++)
+    {
+        if (lcd->stats.hist[i])
+            seq_printf(m, "  <%-8llu %llu\n", 1ULL << i, lcd->stats.hist[i]);
+    }
+
+    seq_puts(m, "pixels/s:\n");
+    for (i = 0; i < BUS_BACKEND_COUNT; i++)
+    {
+        if (lcd->stats.backend_ns[i])
+            seq_printf(m, "  %-8s %llu%s\n", bus_backends[i].name,
+                       div64_u64(lcd->stats.backend_pixels[i] * NSEC_PER_SEC, lcd->stats.backend_ns[i]),
+                       i == BUS_BACKEND(lcd) ? " (active)" : "");
+    }
+
+    return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, stats_show, inode->i_private);
+}
+
+// Any write clears the counters
+static ssize_t stats_write(struct file *file, const char __user *buf, size_t len, loff_t *off)
+{
+    struct ssd1963 *lcd = file_inode(file)->i_private;
+
+    memset(&lcd->stats, 0, sizeof(lcd->stats));
+    return len;
+}
+
+static const struct file_operations stats_fops = {
+    .owner = THIS_MODULE,
+    .open = stats_open,
+    .read = seq_read,
+    .write = stats_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+// Per panel files in ssd1963/panel<n>/
+static void stats_init(struct ssd1963 *lcd)
+{
+    char name[16];
+
+    snprintf(name, sizeof(name), "panel%d", lcd->index);
+    lcd->debugfs = debugfs_create_dir(name, debugfs_root);
+    debugfs_create_file("stats", 0644, lcd->debugfs, lcd, &stats_fops);
+    debugfs_create_u64("updates", 0444, lcd->debugfs, &lcd->stats.updates);
+    debugfs_create_u64("pixels", 0444, lcd->debugfs, &lcd->stats.pixels);
+    debugfs_create_u64("bus_words", 0444, lcd->debugfs, &lcd->stats.bus_words);
+    debugfs_create_u64("gpio_calls", 0444, lcd->debugfs, &lcd->stats.gpio_calls);
+    debugfs_create_u64("windows", 0444, lcd->debugfs, &lcd->stats.windows);
+    debugfs_create_u64("merged", 0444, lcd->debugfs, &lcd->stats.merged);
+    debugfs_create_u64("dropped", 0444, lcd->debugfs, &lcd->stats.dropped);
+    debugfs_create_u64("preempted", 0444, lcd->debugfs, &lcd->stats.preempted);
+    debugfs_create_u64("streamed", 0444, lcd->debugfs, &lcd->stats.streamed);
+    debugfs_create_file("selftest", 0444, lcd->debugfs, lcd, &selftest_fops);
+    debugfs_create_file("loopback", 0444, lcd->debugfs, lcd, &loopback_fops);
+}
+
+static void stats_exit(struct ssd1963 *lcd)
+{
+    debugfs_remove_recursive(lcd->debugfs);
+}
+
+//############################ frame snapshot #############################
+// The update worker transfers from lcd->xfer, a copy of the frame buffer
+// taken under fb_seq. write() never leaves a torn frame on the glass and the
+// bus transfer does not hold up writers. Clients drawing through mmap must
+// not touch a submitted rectangle before SSD1963_IOC_WAIT returns.
+//#########################################################################
+
+// Bytes per pixel of the frame buffer
+#define FRAME_BPP(lcd)  ((lcd)->format == SSD1963_FORMAT_INDEXED8 ? 1 : 2)
+
+// Copy the on-screen part of a rectangle of the frame buffer into xfer, at
+// the same offset (stride DISP_RES_HOR pixels)
+static bool FrameSnapshot(struct ssd1963 *lcd, int PosX, int PosY, int Width, int Height)
+{
+	int		StartPosX = max(PosX, DISP_COL_MIN);
+	int		EndPosX = min(PosX + Width - 1, DISP_COL_MAX);
+	int		StartPosY = max(PosY, DISP_ROW_MIN);
+	int		EndPosY = min(PosY + Height - 1, DISP_ROW_MAX);
+	size_t	Offset;
+	unsigned int	Seq;
+	int		Row;
+	int		Bpp = FRAME_BPP(lcd);
+
+	if (!lcd->framebuffer || !lcd->xfer)
+		return false;
+	if ((EndPosX < StartPosX) || (EndPosY < StartPosY))
+		return true;
+
+	do
+	{
+		Seq = read_seqcount_begin(&lcd->fb_seq);
+		for (Row = StartPosY; Row <= EndPosY; Row++)
+		{
+			Offset = ((Row * DISP_RES_HOR) + StartPosX) * Bpp;
+			memcpy(lcd->xfer + Offset, lcd->framebuffer + Offset, (EndPosX - StartPosX + 1) * Bpp);
+		}
+	} while (read_seqcount_retry(&lcd->fb_seq, Seq));
+
+	return true;
+}
+
+// Copy the first Bytes of the frame buffer into xfer, for packed rectangles
+static bool FrameSnapshotPacked(struct ssd1963 *lcd, size_t Bytes)
+{
+	unsigned int	Seq;
+
+	if (!lcd->framebuffer || !lcd->xfer)
+		return false;
+
+	do
+	{
+		Seq = read_seqcount_begin(&lcd->fb_seq);
+		memcpy(lcd->xfer, lcd->framebuffer, Bytes);
+	} while (read_seqcount_retry(&lcd->fb_seq, Seq));
+
+	return true;
+}
+
+//#########################################################################
+
+//############################ streaming window ###########################
+// SSD1963_IOC_STREAM. write() copies a frame into a free slot of the ring, or
+// over the oldest queued frame when the worker falls behind, and the worker
+// draws the newest queued frame. The stream window is programmed once: as
+// long as nothing else opened a window, a frame is the memory write command
+// followed by its pixels.
+//#########################################################################
+
+// Slot for the next frame, with stream_lock held. Writers are serialized and
+// the worker sends one slot at a time, so with two slots or more one is
+// always free or queued.
+static int stream_slot_get(struct ssd1963 *lcd)
+{
+    int i, slot = -1;
+
+    for (i = 0; i < lcd->stream.nbufs; i++)
+    {
+        if (lcd->stream_state[i] == STREAM_FREE)
+            return i;
+        if (lcd->stream_state[i] == STREAM_QUEUED &&
+            (slot < 0 || (s32)(lcd->stream_seq[i] - lcd->stream_seq[slot]) < 0))
+            slot = i;
+    }
+    lcd->stats.dropped++;       //overwrite the oldest queued frame
+    return slot;
+}
+
+// Newest queued frame, the older queued frames are stale
+static int stream_take(struct ssd1963 *lcd)
+{
+    int i, slot = -1;
+
+    spin_lock(&lcd->stream_lock);
+    for (i = 0; i < lcd->stream.nbufs; i++)
+    {
+        if (lcd->stream_state[i] != STREAM_QUEUED)
+            continue;
+        if (slot >= 0 && (s32)(lcd->stream_seq[i] - lcd->stream_seq[slot]) < 0)
+        {
+            lcd->stream_state[i] = STREAM_FREE;
+            lcd->stats.dropped++;
+            continue;
+        }
+        if (slot >= 0)
+        {
+            lcd->stream_state[slot] = STREAM_FREE;
+            lcd->stats.dropped++;
+        }
+        slot = i;
+    }
+    if (slot >= 0)
+        lcd->stream_state[slot] = STREAM_SENDING;
+    spin_unlock(&lcd->stream_lock);
+
+    return slot;
+}
+
+// Draw the newest stream frame, with bus_lock held
+static void stream_send(struct ssd1963 *lcd)
+{
+	const struct ssd1963_stream *s = &lcd->stream;
+	int		EndPosX = s->col + s->width - 1;
+	int		EndPosY = s->row + s->height - 1;
+	int		CurCol;
+	int		CurRow;
+	const char	*Src;
+	u16		Pixel;
+	int		slot;
+
+	if (!s->nbufs)
+		return;
+	slot = stream_take(lcd);
+	if (slot < 0)
+		return;
+
+	trace_ssd1963_dequeue("stream", s->col, s->row, s->width, s->height);
+	lcd->stats.pixels += s->width * s->height;
+	lcd->stats.streamed++;
+
+	if (lcd->stream_window && lcd->stream_window_mock == BUS_MOCK())
+	{
+		CmdWrite(lcd, 0x2C);	// memory write restarts at the window origin
+		trace_ssd1963_xfer_start(s->width * s->height);
+	}
+	else
+	{
+		WindowSet(lcd, s->col, EndPosX, s->row, EndPosY);
+		lcd->stream_window = true;
+		lcd->stream_window_mock = BUS_MOCK();
+	}
+
+	Src = lcd->stream_ring + (slot * lcd->stream_bytes);
+	for (CurRow = s->row; CurRow <= EndPosY; CurRow++)
+	{
+		for (CurCol = s->col; CurCol <= EndPosX; CurCol++, Src += 2)
+		{
+			Pixel = (*(Src + 1) << 8) | (u8)*Src;	// frame is little endian
+			DataWrite(lcd, Pixel);
+			if (lcd->ShadowBuffer)
+				lcd->ShadowBuffer[(CurRow * DISP_RES_HOR) + CurCol] = Pixel;
+		}
+	}
+	trace_ssd1963_xfer_end(s->width * s->height);
+
+	spin_lock(&lcd->stream_lock);
+	lcd->stream_state[slot] = STREAM_FREE;
+	spin_unlock(&lcd->stream_lock);
+
+	SpriteDamage(lcd, s->col, EndPosX, s->row, EndPosY);
+}
+
+// Queue one frame from write(), with fb_lock held
+static ssize_t stream_write(struct ssd1963 *lcd, const char __user *buf, size_t len)
+{
+    char *frame;
+    int slot;
+
+    if (len < lcd->stream_bytes)
+        return -EINVAL;
+
+    spin_lock(&lcd->stream_lock);
+    slot = stream_slot_get(lcd);
+    lcd->stream_state[slot] = STREAM_FILLING;
+    spin_unlock(&lcd->stream_lock);
+
+    frame = lcd->stream_ring + (slot * lcd->stream_bytes);
+    if (copy_from_user(frame, buf, lcd->stream_bytes))
+    {
+        spin_lock(&lcd->stream_lock);
+        lcd->stream_state[slot] = STREAM_FREE;
+        spin_unlock(&lcd->stream_lock);
+        return -EFAULT;
+    }
+
+    // The slot is still ours while FILLING
+    capture_record(lcd, SSD1963_CAPTURE_STREAM, lcd->stream.col, lcd->stream.row, lcd->stream.width,
+                   lcd->stream.height, 0, lcd->stream.nbufs, frame, lcd->stream.width * 2);
+
+    spin_lock(&lcd->stream_lock);
+    lcd->stream_seq[slot] = lcd->stream_next++;
+    lcd->stream_state[slot] = STREAM_QUEUED;
+    spin_unlock(&lcd->stream_lock);
+
+    trace_ssd1963_submit("stream", lcd->stream.col, lcd->stream.row, lcd->stream.width, lcd->stream.height);
+    ssd1963_kick(lcd);
+
+    return lcd->stream_bytes;
+}
+
+// Start, reconfigure (same file) or stop (nbufs 0) the stream
+static int stream_config(struct ssd1963 *lcd, struct file *filp, const struct ssd1963_stream *req)
+{
+    char *ring = NULL, *old;
+    size_t bytes = (size_t)req->width * req->height * 2;
+    int i;
+
+    if (req->nbufs)
+    {
+        if (req->nbufs < 2 || req->nbufs > SSD1963_STREAM_MAX_BUFS ||
+            req->width == 0 || req->height == 0 ||
+            req->col < DISP_COL_MIN || req->col + req->width - 1 > DISP_COL_MAX ||
+            req->row < DISP_ROW_MIN || req->row + req->height - 1 > DISP_ROW_MAX)
+            return -EINVAL;
+        ring = vmalloc(req->nbufs * bytes);
+        if (!ring)
+            return -ENOMEM;
+    }
+
+    mutex_lock(&lcd->fb_lock);
+    if (lcd->stream.nbufs && lcd->stream_owner != filp)
+    {
+        mutex_unlock(&lcd->fb_lock);
+        vfree(ring);
+        return -EBUSY;
+    }
+
+    mutex_lock(&lcd->bus_lock);
+    for (i = 0; i < lcd->stream.nbufs; i++)
+        lcd->stats.dropped += (lcd->stream_state[i] == STREAM_QUEUED);
+    old = lcd->stream_ring;
+    lcd->stream_ring = ring;
+    lcd->stream_bytes = ring ? bytes : 0;
+    lcd->stream = *req;
+    lcd->stream_owner = ring ? filp : NULL;
+    memset(lcd->stream_state, STREAM_FREE, sizeof(lcd->stream_state));
+    lcd->stream_window = false;
+    mutex_unlock(&lcd->bus_lock);
+    mutex_unlock(&lcd->fb_lock);
+
+    vfree(old);
+    return 0;
+}
+
+//########################### compressed uploads ##########################
+// SSD1963_IOC_COMPRESSED and compressed write()s. Only the compressed bytes
+// are copied from userspace. RLE runs are decoded straight into the bus
+// stream, a run being one data word followed by write strobes. LZ4 blocks are
+// decoded into xfer by the worker, no frame is materialized on the way in.
+//#########################################################################
+
+#define COMPRESSED_QUEUE_MAX    8       //queued rectangles before writers wait
+
+struct compressed_req {
+    struct list_head list;
+    struct ssd1963_compressed hdr;
+    u8 data[];                          //hdr.length bytes
+};
+
+// Runs must be complete and cover the rectangle exactly
+static bool compressed_rle_valid(const u8 *Src, u32 Length, u32 Pixels)
+{
+    u32 Total = 0, Count;
+
+    if (Length % 4)
+        return false;
+    for (; Length; Length -= 4, Src += 4)
+    {
+        Count = (Src[1] << 8) | Src[0];
+        if (!Count || Count > Pixels - Total)
+            return false;
+        Total += Count;
+    }
+    return Total == Pixels;
+}
+
+static int compressed_queue(struct ssd1963 *lcd, const struct ssd1963_compressed *hdr, const void __user *data)
+{
+    struct compressed_req *req;
+    u32 pixels = (u32)hdr->width * hdr->height;
+    int ret;
+
+    if ((hdr->method != SSD1963_COMPRESS_RLE && hdr->method != SSD1963_COMPRESS_LZ4) ||
+        hdr->width == 0 || hdr->height == 0 ||
+        hdr->col < DISP_COL_MIN || hdr->col + hdr->width - 1 > DISP_COL_MAX ||
+        hdr->row < DISP_ROW_MIN || hdr->row + hdr->height - 1 > DISP_ROW_MAX ||
+        hdr->length == 0 || hdr->length > pixels * 4)
+        return -EINVAL;
+
+    req = kvmalloc(sizeof(*req) + hdr->length, GFP_KERNEL);
+    if (!req)
+        return -ENOMEM;
+    req->hdr = *hdr;
+    if (copy_from_user(req->data, data, hdr->length))
+    {
+        kvfree(req);
+        return -EFAULT;
+    }
+    if (hdr->method == SSD1963_COMPRESS_RLE && !compressed_rle_valid(req->data, hdr->length, pixels))
+    {
+        kvfree(req);
+        return -EINVAL;
+    }
+    capture_record_bytes(lcd, SSD1963_CAPTURE_COMPRESSED, hdr->col, hdr->row, hdr->width, hdr->height, 0,
+                         hdr->method, req->data, hdr->length);
+
+    // The worker frees a slot each run and wakes done_wait
+    for (;;)
+    {
+        spin_lock(&lcd->submit_lock);
+        if (lcd->compressed_count < COMPRESSED_QUEUE_MAX)
+        {
+            list_add_tail(&req->list, &lcd->compressed);
+            lcd->compressed_count++;
+            spin_unlock(&lcd->submit_lock);
+            break;
+        }
+        spin_unlock(&lcd->submit_lock);
+
+        ret = wait_event_interruptible(lcd->done_wait,
+                                       READ_ONCE(lcd->compressed_count) < COMPRESSED_QUEUE_MAX);
+        if (ret)
+        {
+            kvfree(req);
+            return ret;
+        }
+    }
+
+    trace_ssd1963_submit("compressed", hdr->col, hdr->row, hdr->width, hdr->height);
+    ssd1963_kick(lcd);
+
+    return 0;
+}
+
+static void compressed_draw(struct ssd1963 *lcd, const struct compressed_req *req)
+{
+	const struct ssd1963_compressed *hdr = &req->hdr;
+	int		EndPosX = hdr->col + hdr->width - 1;
+	int		EndPosY = hdr->row + hdr->height - 1;
+	int		CurCol = hdr->col;
+	int		CurRow = hdr->row;
+	const u8	*Src;
+	u32		Count;
+	u16		Pixel;
+
+	if (hdr->method == SSD1963_COMPRESS_LZ4)
+	{
+		if (!lcd->xfer || LZ4_decompress_safe((const char *)req->data, lcd->xfer, hdr->length,
+											  hdr->width * hdr->height * 2) != hdr->width * hdr->height * 2)
+		{
+			lcd->stats.dropped++;	// corrupt block
+			return;
+		}
+		DispRectCopy(lcd, hdr->col, hdr->row, hdr->width, hdr->height, lcd->xfer);
+		return;
+	}
+
+	lcd->stats.pixels += hdr->width * hdr->height;
+
+	WindowSet(lcd, hdr->col, EndPosX, hdr->row, EndPosY);
+	for (Src = req->data; Src < req->data + hdr->length; Src += 4)
+	{
+		Count = (Src[1] << 8) | Src[0];
+		Pixel = (Src[3] << 8) | Src[2];		// runs are little endian
+		DataRepeat(lcd, Pixel, Count);
+		for (; lcd->ShadowBuffer && Count; Count--)
+		{
+			lcd->ShadowBuffer[(CurRow * DISP_RES_HOR) + CurCol] = Pixel;
+			if (++CurCol > EndPosX)
+			{
+				CurCol = hdr->col;
+				CurRow++;
+			}
+		}
+	}
+	trace_ssd1963_xfer_end(hdr->width * hdr->height);
+
+	SpriteDamage(lcd, hdr->col, EndPosX, hdr->row, EndPosY);
+}
+
+// Draw the queued compressed rectangles, with bus_lock held
+static void compressed_drain(struct ssd1963 *lcd)
+{
+    struct compressed_req *req;
+
+    for (;;)
+    {
+        spin_lock(&lcd->submit_lock);
+        req = list_first_entry_or_null(&lcd->compressed, struct compressed_req, list);
+        if (req)
         {
-            DispRectCopy(p_col, p_row, p_width, p_height, framebuffer);
+            list_del(&req->list);
+            lcd->compressed_count--;
         }
-        else
-            printk(KERN_ALERT "framebuffer addess is null!\n");
+        spin_unlock(&lcd->submit_lock);
+        if (!req)
+            break;
+
+        trace_ssd1963_dequeue("compressed", req->hdr.col, req->hdr.row, req->hdr.width, req->hdr.height);
+        compressed_draw(lcd, req);
+        kvfree(req);
     }
-    else if(p_img == 3)
+}
+
+// Once the update worker is stopped
+static void compressed_clear(struct ssd1963 *lcd)
+{
+    struct compressed_req *req, *tmp;
+
+    list_for_each_entry_safe(req, tmp, &lcd->compressed, list)
+        kvfree(req);
+    INIT_LIST_HEAD(&lcd->compressed);
+    lcd->compressed_count = 0;
+}
+
+//############################ prep pipeline ##############################
+// Large rectangles are cut into stripes of rows. The prep workqueue converts
+// the stripes from the frame snapshot into bus words and diffs them against
+// the shadow buffer on the other CPUs, while the update worker, the only bus
+// owner, sends the stripes in order as they become ready. Stripes equal to
+// what is on the glass are not sent.
+//#########################################################################
+
+static struct workqueue_struct *prep_wq;
+
+static void prep_stripe_work(struct work_struct *work)
+{
+    struct prep_stripe *st = container_of(work, struct prep_stripe, work);
+    struct ssd1963 *lcd = st->lcd;
+    bool indexed = (lcd->format == SSD1963_FORMAT_INDEXED8);
+    u16 *dst = st->words;
+    const u8 *src;
+    u16 pixel;
+    int col, row;
+
+    st->changed = !lcd->ShadowExact;
+    for (row = st->startY; row <= st->endY; row++)
     {
-        //display original sample image
-        DispRectCopy(0, 0, DISP_RES_HOR, DISP_RES_VER, ImageArray);
+        src = (const u8 *)lcd->xfer + (((row * DISP_RES_HOR) + st->startX) * (indexed ? 1 : 2));
+        for (col = st->startX; col <= st->endX; col++)
+        {
+            if (indexed)
+                pixel = lcd->palette[*src++];
+            else
+            {
+                pixel = (src[1] << 8) | src[0];     //frame is little endian
+                src += 2;
+            }
+            *dst++ = pixel;
+            if (lcd->ShadowBuffer && lcd->ShadowBuffer[(row * DISP_RES_HOR) + col] != pixel)
+            {
+                lcd->ShadowBuffer[(row * DISP_RES_HOR) + col] = pixel;
+                st->changed = true;
+            }
+        }
     }
-    else if(p_img == 4)
+    complete(&st->done);
+}
+
+// Send a rectangle of the frame snapshot in xfer through the prep pipeline,
+// with bus_lock held. Returns false if the rectangle is too small to be split,
+// the caller then draws it on its own.
+static bool FramePrepCopy(struct ssd1963 *lcd, int PosX, int PosY, int Width, int Height)
+{
+	int		StartPosX = max(PosX, DISP_COL_MIN);
+	int		EndPosX = min(PosX + Width - 1, DISP_COL_MAX);
+	int		StartPosY = max(PosY, DISP_ROW_MIN);
+	int		EndPosY = min(PosY + Height - 1, DISP_ROW_MAX);
+	int		Rows = EndPosY - StartPosY + 1;
+	int		Stripes, StripeRows, i;
+	struct prep_stripe	*st;
+	const u16	*Words;
+	int		Count;
+	int		Sent = 0;
+	bool	Open = false;
+
+	if (!prep_wq || !lcd->prep_words || (EndPosX < StartPosX) || (Rows < 2 * PREP_STRIPE_ROWS))
+		return false;
+
+	Stripes = min(PREP_STRIPES, Rows / PREP_STRIPE_ROWS);
+	StripeRows = DIV_ROUND_UP(Rows, Stripes);
+	Stripes = DIV_ROUND_UP(Rows, StripeRows);
+	for (i = 0; i < Stripes; i++)
+	{
+		st = &lcd->prep[i];
+		st->startX = StartPosX;
+		st->endX = EndPosX;
+		st->startY = StartPosY + (i * StripeRows);
+		st->endY = min(st->startY + StripeRows - 1, EndPosY);
+		st->words = lcd->prep_words + ((i * StripeRows) * (EndPosX - StartPosX + 1));
+		reinit_completion(&st->done);
+		queue_work(prep_wq, &st->work);
+	}
+
+	for (i = 0; i < Stripes; i++)
+	{
+		st = &lcd->prep[i];
+		Count = (st->endY - st->startY + 1) * (EndPosX - StartPosX + 1);
+		if (!completion_done(&st->done))
+			lcd->stats.prep_stalls++;
+		wait_for_completion(&st->done);
+		if (!st->changed)
+		{
+			lcd->stats.prep_skipped++;
+			lcd->stats.prep_skipped_pixels += Count;
+			Open = false;
+			continue;
+		}
+
+		// The window runs to the end of the rectangle, a skipped stripe
+		// ends the memory write and the next changed one opens a new window
+		if (!Open)
+			WindowSet(lcd, StartPosX, EndPosX, st->startY, EndPosY);
+		Open = true;
+		for (Words = st->words; Words < st->words + Count; Words++)
+			DataWrite(lcd, *Words);
+		Sent += Count;
+	}
+	// Only the pixels on the bus count for the rates
+	lcd->stats.pixels += Sent;
+	trace_ssd1963_xfer_end(Sent);
+
+	// Nothing is skipped before the shadow buffer is exact, so a full frame
+	// sent to the panel makes it exact
+	if (lcd->ShadowBuffer && !BUS_MOCK() && StartPosX == DISP_COL_MIN && EndPosX == DISP_COL_MAX &&
+		StartPosY == DISP_ROW_MIN && EndPosY == DISP_ROW_MAX)
+		lcd->ShadowExact = true;
+
+	SpriteDamage(lcd, StartPosX, EndPosX, StartPosY, EndPosY);
+	return true;
+}
+
+static void prep_init(struct ssd1963 *lcd)
+{
+    int i;
+
+    for (i = 0; i < PREP_STRIPES; i++)
     {
-        //display 2nd sample image
-        DispRectCopy(0, 0, DISP_RES_HOR, DISP_RES_VER, Image2Array);
+        INIT_WORK(&lcd->prep[i].work, prep_stripe_work);
+        init_completion(&lcd->prep[i].done);
+        lcd->prep[i].lcd = lcd;
     }
-    else if(p_img == 5)
+}
+
+//############################ update scheduler ###########################
+// Submitted rectangles are kept per priority class and drawn most urgent
+// first. A low priority rectangle is drawn p_chunkRows rows at a time and the
+// rest goes back to its class, so an alarm submitted during a full screen
+// background redraw waits for one band at most.
+//#########################################################################
+
+// Add a rectangle to the pending one of its class, with submit_lock held.
+// Returns true if it was merged into a rectangle not drawn yet.
+static bool submit_merge(struct ssd1963 *lcd, int prio, const struct ssd1963_submit *req)
+{
+    struct ssd1963_submit *damage = &lcd->fb_damage[prio];
+    int col, row, endCol, endRow;
+
+    if (!lcd->fb_damage_pending[prio])
     {
-        //display clock test image
-        DispRectCopy(0, 0, DISP_RES_HOR, DISP_RES_VER, ClocktestImage);
+        *damage = *req;
+        lcd->fb_damage_pending[prio] = true;
+        return false;
     }
-    else if(p_img == 6)
+
+    col = min(damage->col, req->col);
+    row = min(damage->row, req->row);
+    endCol = max(damage->col + damage->width, req->col + req->width);
+    endRow = max(damage->row + damage->height, req->row + req->height);
+    damage->col = col;
+    damage->row = row;
+    damage->width = endCol - col;
+    damage->height = endRow - row;
+    return true;
+}
+
+// Most urgent pending rectangle, -1 if there is none
+static int submit_take(struct ssd1963 *lcd, struct ssd1963_submit *damage)
+{
+    int prio;
+
+    spin_lock(&lcd->submit_lock);
+    for (prio = 0; prio < SSD1963_PRIO_COUNT; prio++)
     {
-        //display color band test image
-        DispRectCopy(0, 0, DISP_RES_HOR, DISP_RES_VER, ColorbandsImage);
+        if (lcd->fb_damage_pending[prio])
+        {
+            *damage = lcd->fb_damage[prio];
+            lcd->fb_damage_pending[prio] = false;
+            break;
+        }
     }
-    else if(p_img == 7)
+    spin_unlock(&lcd->submit_lock);
+
+    return (prio < SSD1963_PRIO_COUNT) ? prio : -1;
+}
+
+static void submit_draw(struct ssd1963 *lcd, const struct ssd1963_submit *damage)
+{
+    if(!FrameSnapshot(lcd, damage->col, damage->row, damage->width, damage->height))
+        lcd->stats.dropped++;
+    else if(FramePrepCopy(lcd, damage->col, damage->row, damage->width, damage->height))
+        return;
+    else if(lcd->format == SSD1963_FORMAT_INDEXED8)
+        DispFrameIndexedCopy(lcd, damage->col, damage->row, damage->width, damage->height, (const u8 *)lcd->xfer);
+    else
+        DispFrameCopy(lcd, damage->col, damage->row, damage->width, damage->height, lcd->xfer);
+}
+
+// Draw the submitted rectangles, with bus_lock held
+static void submit_drain(struct ssd1963 *lcd)
+{
+    struct ssd1963_submit damage, rest;
+    int prio, rows, i;
+    bool urgent;
+
+    while ((prio = submit_take(lcd, &damage)) >= 0)
     {
-        //display gradient test image
-        DispRectCopy(0, 0, DISP_RES_HOR, DISP_RES_VER, GradientImage);
+        trace_ssd1963_dequeue("submit", damage.col, damage.row, damage.width, damage.height);
+
+        rows = max(READ_ONCE(p_chunkRows), 1);
+        if (prio != SSD1963_PRIO_LOW || damage.height <= rows)
+        {
+            submit_draw(lcd, &damage);
+            continue;
+        }
+
+        // One band, the rows below go back to the low class where newer low
+        // priority requests merge with them
+        rest = damage;
+        rest.row += rows;
+        rest.height -= rows;
+        damage.height = rows;
+        submit_draw(lcd, &damage);
+
+        spin_lock(&lcd->submit_lock);
+        submit_merge(lcd, prio, &rest);
+        for (urgent = false, i = 0; i < prio; i++)
+            urgent |= lcd->fb_damage_pending[i];
+        spin_unlock(&lcd->submit_lock);
+        if (urgent)
+            lcd->stats.preempted++;
     }
-    else if(p_img == 8)
+}
+
+//#########################################################################
+
+static void ssd1963_update_all(struct ssd1963 *lcd)
+{
+    queue_delayed_work(lcd->wq, &lcd->work, SSD1963_PERIOD);
+}
+
+static void ssd1963_update(struct work_struct *work)
+{
+    struct ssd1963 *lcd = container_of(to_delayed_work(work), struct ssd1963, work);
+    struct ssd1963_cache_show show;
+    struct img_cache_entry *entry;
+    int img, col, row, width, height;
+    bool pending;
+    u64 start = ktime_get_ns();
+    u64 pixels;
+    u32 seq;
+
+    mutex_lock(&lcd->bus_lock);
+    seq = atomic_read(&lcd->submit_seq);
+    pixels = lcd->stats.pixels;
+    p_updates++;
+
+    submit_drain(lcd);
+    compressed_drain(lcd);
+
+    //the image module parameters drive the first panel, a request written
+    //while this one is drawn is kept for the next run
+    img = (lcd->index == 0) ? xchg(&p_img, 0) : 0;
+    if(img == 2)
     {
-        //display sharpness test image
-        DispRectCopy(0, 0, DISP_RES_HOR, DISP_RES_VER, SharpnessImage);
+        //pull image data from frame buffer
+        col = READ_ONCE(p_col);
+        row = READ_ONCE(p_row);
+        width = READ_ONCE(p_width);
+        height = READ_ONCE(p_height);
+        //the packed rectangle must fit in the frame buffer, checked before
+        //multiplying so large parameters cannot overflow
+        if(width <= 0 || height <= 0 || width > DISP_PIX_TOT / height)
+            lcd->stats.dropped++;
+        else if(lcd->format == SSD1963_FORMAT_INDEXED8)
+        {
+            //the capture log only holds RGB565 payloads
+            if(!FrameSnapshotPacked(lcd, (size_t)width * height))
+                lcd->stats.dropped++;
+            else
+            {
+                trace_ssd1963_dequeue("framebuffer", col, row, width, height);
+                capture_record(lcd, SSD1963_CAPTURE_PACKED, col, row, width, height, 0, 0, NULL, 0);
+                DispRectIndexedCopy(lcd, col, row, width, height, (const u8 *)lcd->xfer);
+            }
+        }
+        else if(FrameSnapshotPacked(lcd, (size_t)width * height * 2))
+        {
+            trace_ssd1963_dequeue("framebuffer", col, row, width, height);
+            capture_record(lcd, SSD1963_CAPTURE_PACKED, col, row, width, height, 0, 0,
+                           lcd->xfer, width * 2);
+            DispRectCopy(lcd, col, row, width, height, lcd->xfer);
+        }
+        else
+            printk(KERN_ALERT "framebuffer addess is null!\n");
     }
-    else if(p_img > 0)
+    else if(img > 0)
     {
-        //display splash image
-        DispRectCopy(0, 0, DISP_RES_HOR, DISP_RES_VER, Image3Array);
+        //display a built-in or cached image, falling back to the splash image
+        trace_ssd1963_dequeue("image", 0, 0, 0, 0);
+        capture_record(lcd, SSD1963_CAPTURE_IMAGE, 0, 0, 0, 0, img, 0, NULL, 0);
+        if(!img_cache_show(lcd, img, 0, 0))
+            img_cache_show(lcd, 1, 0, 0);
     }
-    p_img = 0;
 
-    schedule_delayed_work(&ssd1963_work, SSD1963_PERIOD);
+    mutex_lock(&lcd->img_cache_lock);
+    show = lcd->img_show;
+    pending = lcd->img_show_pending;
+    lcd->img_show_pending = false;
+    entry = pending ? img_cache_find(lcd, show.id) : NULL;
+    if(entry)
+        trace_ssd1963_dequeue("cache", show.col, show.row, entry->width, entry->height);
+    mutex_unlock(&lcd->img_cache_lock);
+    if(pending && !img_cache_show(lcd, show.id, show.col, show.row))
+        lcd->stats.dropped++;    //evicted before it could be drawn
+
+    stream_send(lcd);
+
+    sprite_flush(lcd);
+
+    if(lcd->stats.pixels != pixels)
+        stats_record(lcd, ktime_get_ns() - start, lcd->stats.pixels - pixels);
+    mutex_unlock(&lcd->bus_lock);
+
+    WRITE_ONCE(lcd->done_seq, seq);
+    wake_up_all(&lcd->done_wait);
+
+    ssd1963_update_all(lcd);
 
     return;
 }
 
-static int __init ssd1963_probe(struct platform_device *dev)
+// Control and data lines of the panel, from the device tree:
+//   lcd-rs-gpios, lcd-wr-gpios, lcd-rd-gpios, lcd-cs-gpios, lcd-reset-gpios,
+//   lcd-disp-gpios       control lines, raw levels (see CS_ENA() and friends)
+//   lcd-power-gpios      optional, power enable
+//   lcd-pin-data-gpios   DB[15:0], DB0 first
+//   solomon,data-reg     optional, physical address of the GPIO bank data
+//                        register holding DB[15:0] and /WR, enables the
+//                        writel and pointer bus backends
+// The lines keep their state until DispAdopt() or DispInit() takes them over,
+// so a panel left running by U-Boot does not glitch.
+static int DispGpioGet(struct ssd1963 *lcd)
+{
+	static const struct { const char *name; size_t offset; } lines[] = {
+		{ "lcd-rs",		offsetof(struct ssd1963, gpio_rs) },
+		{ "lcd-wr",		offsetof(struct ssd1963, gpio_wr) },
+		{ "lcd-rd",		offsetof(struct ssd1963, gpio_rd) },
+		{ "lcd-cs",		offsetof(struct ssd1963, gpio_cs) },
+		{ "lcd-reset",	offsetof(struct ssd1963, gpio_rst) },
+		{ "lcd-disp",	offsetof(struct ssd1963, gpio_disp) },
+	};
+	struct gpio_desc	**desc;
+	u32		reg;
+	int		i;
+
+	for (i = 0; i < ARRAY_SIZE(lines); i++)
+	{
+		desc = (struct gpio_desc **)((char *)lcd + lines[i].offset);
+		*desc = devm_gpiod_get(lcd->dev, lines[i].name, GPIOD_ASIS);
+		if (IS_ERR(*desc))
+		{
+			dev_err(lcd->dev, "Unable to get %s-gpios! %ld\n", lines[i].name, PTR_ERR(*desc));
+			return PTR_ERR(*desc);
+		}
+	}
+
+	lcd->gpio_pwr = devm_gpiod_get_optional(lcd->dev, "lcd-power", GPIOD_ASIS);
+	if (IS_ERR(lcd->gpio_pwr))
+		return PTR_ERR(lcd->gpio_pwr);
+
+	lcd->gpio_data = devm_gpiod_get_array(lcd->dev, "lcd-pin-data", GPIOD_ASIS);
+	if (IS_ERR(lcd->gpio_data))
+	{
+		dev_err(lcd->dev, "Unable to get LCD data pin array! %ld\n", PTR_ERR(lcd->gpio_data));
+		return PTR_ERR(lcd->gpio_data);
+	}
+	if (lcd->gpio_data->ndescs != LCD_DATA_PINS)
+	{
+		dev_err(lcd->dev, "LCD data pin array has %u pins, %d needed\n",
+				lcd->gpio_data->ndescs, LCD_DATA_PINS);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(lines); i++)
+		if (gpiod_cansleep(*(struct gpio_desc **)((char *)lcd + lines[i].offset)))
+			lcd->gpio_cansleep = true;
+	for (i = 0; i < LCD_DATA_PINS; i++)
+		if (gpiod_cansleep(lcd->gpio_data->desc[i]))
+			lcd->gpio_cansleep = true;
+	if (lcd->gpio_pwr && gpiod_cansleep(lcd->gpio_pwr))
+		lcd->gpio_cansleep = true;
+	if (lcd->gpio_cansleep)
+		dev_info(lcd->dev, "LCD lines on a sleeping GPIO chip\n");
+
+	if (!of_property_read_u32(lcd->dev->of_node, "solomon,data-reg", &reg))
+	{
+		lcd->data_reg = devm_ioremap(lcd->dev, reg, sizeof(u32));
+		if (!lcd->data_reg)
+			dev_err(lcd->dev, "Unable to map data register 0x%x\n", reg);
+	}
+
+	return 0;
+}
+
+//################################# sysfs #################################
+// bus_backend: viable backends, the active one in brackets. Write a name to
+//              switch, or "auto" to time them again and keep the fastest.
+// bus_rates:   words/s of each backend measured by the last tuning
+//#########################################################################
+
+static ssize_t bus_backend_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ssd1963 *lcd = dev_get_drvdata(dev);
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < BUS_BACKEND_MOCK; i++)
+	{
+		if (!BusBackendViable(lcd, i))
+			continue;
+		len += scnprintf(buf + len, PAGE_SIZE - len, i == lcd->backend ? "[%s] " : "%s ",
+						 bus_backends[i].name);
+	}
+	len += scnprintf(buf + len, PAGE_SIZE - len, "auto\n");
+	return len;
+}
+
+static ssize_t bus_backend_store(struct device *dev, struct device_attribute *attr,
+								 const char *buf, size_t count)
+{
+	struct ssd1963 *lcd = dev_get_drvdata(dev);
+	int i;
+
+	if (sysfs_streq(buf, "auto"))
+	{
+		bool tuned;
+
+		mutex_lock(&lcd->bus_lock);
+		tuned = BusBackendTune(lcd);
+		mutex_unlock(&lcd->bus_lock);
+		if (!tuned)
+			return -ENODEV;
+		ssd1963_update_all(lcd);	// redraw sprites over the timed pixel
+		dev_info(dev, "bus backend %s\n", bus_backends[lcd->backend].name);
+		return count;
+	}
+
+	for (i = 0; i < BUS_BACKEND_MOCK; i++)
+		if (sysfs_streq(buf, bus_backends[i].name))
+			break;
+	if (!BusBackendViable(lcd, i))
+		return -EINVAL;
+
+	mutex_lock(&lcd->bus_lock);
+	lcd->backend = i;
+	mutex_unlock(&lcd->bus_lock);
+	return count;
+}
+static DEVICE_ATTR_RW(bus_backend);
+
+static ssize_t bus_rates_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ssd1963 *lcd = dev_get_drvdata(dev);
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < BUS_BACKEND_COUNT; i++)
+	{
+		if (lcd->bus_rate[i])
+			len += scnprintf(buf + len, PAGE_SIZE - len, "%-8s %llu\n",
+							 bus_backends[i].name, lcd->bus_rate[i]);
+		else
+			len += scnprintf(buf + len, PAGE_SIZE - len, "%-8s n/a\n", bus_backends[i].name);
+	}
+	return len;
+}
+static DEVICE_ATTR_RO(bus_rates);
+
+static struct attribute *ssd1963_attrs[] = {
+	&dev_attr_bus_backend.attr,
+	&dev_attr_bus_rates.attr,
+	NULL,
+};
+
+static const struct attribute_group ssd1963_attr_group = {
+	.attrs = ssd1963_attrs,
+};
+
+static int ssd1963_probe(struct platform_device *dev)
 {
     int ret = 0;
-    struct ssd1963 *item;
+    struct ssd1963 *lcd;
 
     printk(KERN_ALERT "COLOR LCD driver probing (printk)\n");
 	dev_err(&dev->dev, "%s\n", __func__);
 
-	item = devm_kzalloc(&dev->dev,
+	lcd = devm_kzalloc(&dev->dev,
 				sizeof(struct ssd1963),
 				GFP_KERNEL);
-	if (!item) {
+	if (!lcd) {
 		dev_err(&dev->dev,
 			"%s: unable to kzalloc for ssd1963\n", __func__);
 		ret = -ENOMEM;
 		goto out;
 	}
 
-    //item->dev = &dev->dev;
-	//dev_set_drvdata(&dev->dev, item);
-	platform_set_drvdata(dev, item);
-
-//###############################################################3
-    /* Done in UBoot    
-    // Initialize hardware
-	DispInit();
-    // Copy the CliniComp test image, enable the display
-	DispRectCopy(0, 0, DISP_RES_HOR, DISP_RES_VER, Image3Array);
-	DispOn(); */
-
-#if DATA_ARRAY
-    gpio_os = gpiod_get_array(&dev->dev, "lcd-pin-data", GPIOD_OUT_LOW);
-    if(IS_ERR(gpio_os))
-        dev_err(&dev->dev, "Unable to get LCD data pin array! %d\n", PTR_ERR(gpio_os));
+    lcd->dev = &dev->dev;
+	platform_set_drvdata(dev, lcd);
+
+    // A "lcdN" alias fixes the proc entry of a panel, the others take the
+    // first free index
+    ret = of_alias_get_id(dev->dev.of_node, "lcd");
+    if (ret >= 0)
+        ret = ida_alloc_range(&ssd1963_ida, ret, ret, GFP_KERNEL);
     else
-        printk(KERN_ALERT "Got LCD data pin array\n");
-#endif
+        ret = ida_alloc(&ssd1963_ida, GFP_KERNEL);
+    if (ret < 0)
+        goto out;
+    lcd->index = ret;
+    if (lcd->index == 0)
+        snprintf(lcd->name, sizeof(lcd->name), "udas_fb");
+    else
+        snprintf(lcd->name, sizeof(lcd->name), "udas_fb%d", lcd->index);
+
+    lcd->panel = disp_panel_default;
+    ret = DispPanelParse(lcd);
+    if (ret)
+        goto out_ida;
+
+    ret = DispGpioGet(lcd);
+    if (ret)
+        goto out_ida;
+
+    mutex_init(&lcd->bus_lock);
+    init_waitqueue_head(&lcd->done_wait);
+    spin_lock_init(&lcd->submit_lock);
+    spin_lock_init(&lcd->stream_lock);
+    INIT_LIST_HEAD(&lcd->compressed);
+    INIT_LIST_HEAD(&lcd->img_cache);
+    mutex_init(&lcd->img_cache_lock);
+    mutex_init(&lcd->sprite_lock);
+    INIT_DELAYED_WORK(&lcd->work, ssd1963_update);
+
+    // One ordered worker per panel, unbound so the panels transfer in parallel
+    lcd->wq = alloc_workqueue("ssd1963/%d", WQ_UNBOUND, 1, lcd->index);
+    if (!lcd->wq)
+    {
+        ret = -ENOMEM;
+        goto out_ida;
+    }
+
+    lcd->ShadowBuffer = vzalloc(DISP_PIX_TOT * sizeof(u16));
+    if(!lcd->ShadowBuffer)
+        dev_err(&dev->dev, "Unable to allocate shadow buffer, sprites will not be composed\n");
+
+    if(p_busMock && BusModelAlloc(lcd))
+        dev_err(&dev->dev, "Unable to allocate bus model\n");
+
+    lcd->backend = BUS_BACKEND_ARRAY;
+
+    if(p_fastBoot && DispAdopt(lcd))
+    {
+        // U-Boot left the panel configured with the splash image on the glass
+        ShadowRectCopy(lcd, DISP_COL_MIN, min(IMG_RES_HOR - 1, DISP_COL_MAX),
+                       DISP_ROW_MIN, min(IMG_RES_VER - 1, DISP_ROW_MAX), Image3Array, IMG_RES_HOR);
+        dev_info(&dev->dev, "Adopted panel initialized by U-Boot\n");
+    }
+    else
+    {
+        // Initialize hardware
+        DispInit(lcd);
+        // Copy the CliniComp test image, enable the display
+        DispRectCopy(lcd, 0, 0, IMG_RES_HOR, IMG_RES_VER, Image3Array);
+        DispOn(lcd);
+    }
+    // ShadowExact is only set by DispInit(): an adopted panel may show a
+    // different splash than Image3Array, a full frame makes the shadow exact
+
+    if(p_busTune)
+    {
+        mutex_lock(&lcd->bus_lock);
+        if(BusBackendTune(lcd))
+            dev_info(&dev->dev, "Bus backend %s, %llu words/s\n", bus_backends[BUS_BACKEND(lcd)].name,
+                     lcd->bus_rate[BUS_BACKEND(lcd)]);
+        else
+            dev_info(&dev->dev, "No shadow buffer, bus backend %s not tuned\n",
+                     bus_backends[BUS_BACKEND(lcd)].name);
+        mutex_unlock(&lcd->bus_lock);
+    }
+
+    // Removed first thing in ssd1963_remove(), a store must not run on a
+    // panel being torn down
+    ret = device_add_group(&dev->dev, &ssd1963_attr_group);
+    if (ret)
+        goto out_buf;
 
-    INIT_DELAYED_WORK(&ssd1963_work, ssd1963_update);
+    stats_init(lcd);
+    ret = fbinit(lcd); //frame buffer init
+    if (ret)
+        goto out_stats;
 
     // Kick off main loop
-	ssd1963_update_all();
+	ssd1963_update_all(lcd);
 
-    printk(KERN_ALERT "COLOR LCD driver probed\n");
+    dev_info(&dev->dev, "COLOR LCD driver probed, /proc/%s\n", lcd->name);
 
     return ret;
 
 //#################################################################3
 
-/*out_item:
-	kfree(item);*/
+out_stats:
+    stats_exit(lcd);
+    device_remove_group(&dev->dev, &ssd1963_attr_group);
+out_buf:
+    destroy_workqueue(lcd->wq);
+    vfree(lcd->ShadowBuffer);
+    vfree(lcd->bus_model.mem);
+out_ida:
+    ida_free(&ssd1963_ida, lcd->index);
 out:
     printk(KERN_ALERT "COLOR LCD driver failed :(\n");
 	return ret;
@@ -869,13 +3764,36 @@ out:
 
 static int ssd1963_remove(struct platform_device *device)
 {
-	struct ssd1963 *item = platform_get_drvdata(device);
-	if (item) {
-		kfree(item);
-	}
+	struct ssd1963 *lcd = platform_get_drvdata(device);
+
+	// Waits for running sysfs stores, none can start after this
+	device_remove_group(&device->dev, &ssd1963_attr_group);
+
+	// No new requests once the proc entry is gone, then stop the worker
+	fbexit(lcd); //frame buffer exit
+	stats_exit(lcd);
+	cancel_delayed_work_sync(&lcd->work);
+	destroy_workqueue(lcd->wq);
+	fbfree(lcd);
+
+	compressed_clear(lcd);
+	img_cache_clear(lcd);
+	sprite_clear(lcd);
+	vfree(lcd->ShadowBuffer);
+	vfree(lcd->bus_model.mem);
+	ida_free(&ssd1963_ida, lcd->index);
+	// lcd itself is device managed
 	return 0;
 }
 
+// .remove returns void since 6.11
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+static void ssd1963_remove_void(struct platform_device *device)
+{
+	ssd1963_remove(device);
+}
+#endif
+
 static const struct of_device_id ssd1963_ids[] = {
 	{ .compatible = "solomon,ssd1963", },
 	{ /* sentinel */ }
@@ -884,10 +3802,15 @@ MODULE_DEVICE_TABLE(of, ssd1963_ids); //this line necessary to enable auto-loadi
 
 static struct platform_driver ssd1963_driver = {
 	.probe = ssd1963_probe,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+	.remove = ssd1963_remove_void,
+#else
 	.remove = ssd1963_remove,
+#endif
 	.driver = {
 		   .name = "ssd1963fb",
 		   .of_match_table	= ssd1963_ids,
+		   .probe_type = PROBE_PREFER_ASYNCHRONOUS,
 		   .owner = THIS_MODULE,
 		   },
 };
@@ -900,26 +3823,40 @@ static int __init ssd1963_init(void)
 
 	pr_debug("%s\n", __func__);
 
+    // Shared by all panels, the panels add their directory in probe
+    debugfs_root = debugfs_create_dir("ssd1963", NULL);
+    debugfs_create_file("capture", 0400, debugfs_root, NULL, &capture_fops);
+    debugfs_create_u64("capture_dropped", 0444, debugfs_root, &capture_dropped);
+
+    // Shared by all panels, the bus owners stay on their own workqueues
+    if (p_prepThreads > 0)
+    {
+        prep_wq = alloc_workqueue("ssd1963_prep", WQ_UNBOUND | WQ_HIGHPRI, p_prepThreads);
+        if (!prep_wq)
+            pr_err("%s: no prep workqueue, transfers stay serial\n", __func__);
+    }
+
 	ret = platform_driver_register(&ssd1963_driver);
 
 	if (ret) {
 		pr_err("%s: unable to platform_driver_register\n", __func__);
+		if (prep_wq)
+			destroy_workqueue(prep_wq);
+		debugfs_remove_recursive(debugfs_root);
 	}
 
-    fbinit(); //frame buffer init
-
 	return ret;
 }
 module_init(ssd1963_init);
 
 static void __exit ssd1963_exit(void)
 {
-    cancel_delayed_work(&ssd1963_work);
-    flush_scheduled_work();
-
-    fbexit(); //frame buffer exit
-
 	platform_driver_unregister(&ssd1963_driver);    
+
+    if (prep_wq)
+        destroy_workqueue(prep_wq);
+    capture_exit();
+    debugfs_remove_recursive(debugfs_root);
 }
 module_exit(ssd1963_exit);
 
@@ -935,17 +3872,9 @@ MODULE_DESCRIPTION("SSD1963 Driver for OSD043T3491-19");
 #ifndef PAGE_SIZE
 #define PAGE_SIZE       4096
 #endif
-#define BUFFER_PAGES    64
-#define PAGES_ORDER     6   //2^6 = 64 pages
-#define BUFFER_SIZE     (PAGE_SIZE * BUFFER_PAGES)
-
-static const char *filename = "udas_fb";
-
-struct mmap_info {
-    char *data;
-};
-
-struct mmap_info info_global;
+// Sized for one RGB565 frame of the configured panel (2^6 = 64 pages for 480x272)
+#define PAGES_ORDER     (get_order(DISP_PIX_TOT * 2))
+#define BUFFER_SIZE(order)  (PAGE_SIZE << (order))
 
 /* After unmap. */
 static void vm_close(struct vm_area_struct *vma)
@@ -974,6 +3903,8 @@ static vm_fault_t vm_fault(struct vm_fault *vmf)
     if (info)
     {
         if (info->data) {
+            if (vmf->pgoff >= (1UL << info->order))
+                return VM_FAULT_SIGBUS;
             page = virt_to_page(info->data + (PAGE_SIZE * vmf->pgoff));
             //pr_info("count = %d\n", page_count(page));
             get_page(page);
@@ -1007,34 +3938,39 @@ static struct vm_operations_struct vm_ops =
     .open = vm_open,
 };
 
+// Per open file state, filp->private_data
+struct ssd1963_file {
+    struct ssd1963 *lcd;
+    u32 write_mode;         //SSD1963_WRITE_*
+};
+
+#define FILE_LCD(filp)  (((struct ssd1963_file *)(filp)->private_data)->lcd)
+
 static int mmap(struct file *filp, struct vm_area_struct *vma)
 {
     //pr_info("ssd1963: mmap\n");
     vma->vm_ops = &vm_ops;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
     vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
-    vma->vm_private_data = filp->private_data;
+#endif
+    vma->vm_private_data = &FILE_LCD(filp)->info;
     vm_open(vma);
     return 0;
 }
 
 static int open(struct inode *inode, struct file *filp)
 {
-    struct mmap_info *info = &info_global;
+    struct ssd1963_file *file;
 
     //pr_info("ssd1963: open\n");
-    //info = kmalloc(sizeof(struct mmap_info), GFP_KERNEL);
-    //pr_info("virt_to_phys = 0x%lx -> 0x%llx\n", (unsigned long)info,(unsigned long long)virt_to_phys((void *)info));
-    //info->data = (char *)get_zeroed_page(GFP_KERNEL);
-    info->data = (char *)__get_free_pages(GFP_KERNEL, PAGES_ORDER);
-    if(info->data == NULL)
-    {
-        pr_err("Unable to allocate framebuffer!\n");
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file)
         return -ENOMEM;
-    }
-    //pr_info("(0x%lx)\n", (unsigned long)info->data);
-    memset(info->data, 0, PAGE_SIZE << PAGES_ORDER);    //zero the buffer
-    filp->private_data = info;
-    framebuffer = info->data;
+    file->lcd = pde_data(inode);
+    file->write_mode = SSD1963_WRITE_PIXELS;
+    filp->private_data = file;
     return 0;
 }
 
@@ -1044,8 +3980,8 @@ static ssize_t read(struct file *filp, char __user *buf, size_t len, loff_t *off
     int ret;
 
     //pr_info("ssd1963: read\n");
-    info = filp->private_data;
-    ret = min(len, (size_t)BUFFER_SIZE);
+    info = &FILE_LCD(filp)->info;
+    ret = min(len, (size_t)BUFFER_SIZE(info->order));
     if (copy_to_user(buf, info->data, ret)) {
         ret = -EFAULT;
     }
@@ -1054,51 +3990,359 @@ static ssize_t read(struct file *filp, char __user *buf, size_t len, loff_t *off
 
 static ssize_t write(struct file *filp, const char __user *buf, size_t len, loff_t *off)
 {
-    struct mmap_info *info;
+    struct ssd1963_file *file = filp->private_data;
+    struct ssd1963 *lcd = file->lcd;
+    struct mmap_info *info = &lcd->info;
+    struct ssd1963_compressed hdr;
+    size_t bytes;
+    ssize_t ret;
+    u64 start = ktime_get_ns();
+
+    if (READ_ONCE(file->write_mode) == SSD1963_WRITE_COMPRESSED)
+    {
+        // Compressed rectangle, the bytes follow the header
+        if (len < sizeof(hdr))
+            return -EINVAL;
+        if (copy_from_user(&hdr, buf, sizeof(hdr)))
+            return -EFAULT;
+        if (hdr.magic != SSD1963_COMPRESS_MAGIC || hdr.length > len - sizeof(hdr))
+            return -EINVAL;
+        ret = compressed_queue(lcd, &hdr, buf + sizeof(hdr));
+        return ret ? ret : sizeof(hdr) + hdr.length;
+    }
 
     //pr_info("ssd1963: write %d bytes\n", len);
-    info = filp->private_data;
-    if (copy_from_user(info->data, buf, min(len, (size_t)BUFFER_SIZE))) {
+    bytes = min(len, (size_t)BUFFER_SIZE(info->order));
+
+    // The user copy may fault and sleep, so it goes to the staging buffer and
+    // only the memcpy into the frame buffer is inside the write section
+    mutex_lock(&lcd->fb_lock);
+    if (lcd->stream.nbufs) {
+        // Streaming: one frame per write, no copy into the frame buffer
+        ret = stream_write(lcd, buf, len);
+        mutex_unlock(&lcd->fb_lock);
+        return ret;
+    }
+    if (copy_from_user(lcd->fb_stage, buf, bytes)) {
+        mutex_unlock(&lcd->fb_lock);
         return -EFAULT;
-    } else {
-        return len;
+    }
+    preempt_disable();
+    write_seqcount_begin(&lcd->fb_seq);
+    memcpy(info->data, lcd->fb_stage, bytes);
+    write_seqcount_end(&lcd->fb_seq);
+    preempt_enable();
+    mutex_unlock(&lcd->fb_lock);
+
+    trace_ssd1963_user_copy(bytes, ktime_get_ns() - start);
+    return len;
+}
+
+static int submit(struct ssd1963 *lcd, const struct ssd1963_submit *req, u32 prio)
+{
+    struct ssd1963_submit clip;
+    int col, row, endCol, endRow;
+
+    if (req->width == 0 || req->height == 0 || prio >= SSD1963_PRIO_COUNT)
+        return -EINVAL;
+
+    trace_ssd1963_submit("submit", req->col, req->row, req->width, req->height);
+
+    // Only the on-screen part of the rectangle is in the frame buffer. Unions
+    // of clipped rectangles stay on the panel, their size fits the __u16s.
+    col = max_t(int, req->col, DISP_COL_MIN);
+    row = max_t(int, req->row, DISP_ROW_MIN);
+    endCol = min(req->col + req->width - 1, DISP_COL_MAX);
+    endRow = min(req->row + req->height - 1, DISP_ROW_MAX);
+    if (col <= endCol && row <= endRow)
+    {
+        clip.col = col;
+        clip.row = row;
+        clip.width = endCol - col + 1;
+        clip.height = endRow - row + 1;
+
+        // Merge with the rectangle of the class the worker has not picked up yet
+        spin_lock(&lcd->submit_lock);
+        if (submit_merge(lcd, prio, &clip))
+            lcd->stats.merged++;
+        spin_unlock(&lcd->submit_lock);
+    }
+
+    // Indexed frames are logged without pixels, the capture log holds RGB565
+    if (lcd->framebuffer && col <= endCol && row <= endRow)
+        capture_record(lcd, SSD1963_CAPTURE_SUBMIT, col, row, endCol - col + 1, endRow - row + 1, 0, prio,
+                       (READ_ONCE(lcd->format) == SSD1963_FORMAT_INDEXED8) ? NULL :
+                       lcd->framebuffer + (((row * DISP_RES_HOR) + col) * 2), DISP_RES_HOR * 2);
+
+    ssd1963_kick(lcd);
+
+    return 0;
+}
+
+static int wait_done(struct ssd1963 *lcd, u32 timeout_ms)
+{
+    u32 target = atomic_read(&lcd->submit_seq);
+    long ret;
+
+    ret = wait_event_interruptible_timeout(lcd->done_wait,
+                                           (s32)(READ_ONCE(lcd->done_seq) - target) >= 0,
+                                           msecs_to_jiffies(timeout_ms));
+    if (ret < 0)
+        return ret;
+    return ret ? 0 : -ETIMEDOUT;
+}
+
+static int format_set(struct ssd1963 *lcd, u32 format)
+{
+    if (format != SSD1963_FORMAT_RGB565 && format != SSD1963_FORMAT_INDEXED8)
+        return -EINVAL;
+
+    // Rectangles still pending are drawn in the new format, the client
+    // redraws and submits after switching
+    mutex_lock(&lcd->fb_lock);
+    mutex_lock(&lcd->bus_lock);
+    lcd->format = format;
+    mutex_unlock(&lcd->bus_lock);
+    mutex_unlock(&lcd->fb_lock);
+
+    return 0;
+}
+
+// Submit the bounding box of the indexed pixels using an entry of
+// [first, first + count), nothing else changes on the glass
+static void palette_damage(struct ssd1963 *lcd, unsigned int first, unsigned int count)
+{
+    struct ssd1963_submit rect;
+    const u8 *Src = (const u8 *)lcd->framebuffer;
+    int col, row, minCol = DISP_COL_MAX + 1, maxCol = -1, minRow = -1, maxRow = -1;
+
+    for (row = DISP_ROW_MIN; row <= DISP_ROW_MAX; row++)
+    {
+        for (col = DISP_COL_MIN; col <= DISP_COL_MAX; col++, Src++)
+        {
+            if ((unsigned int)(*Src - first) >= count)
+                continue;
+            if (minRow < 0)
+                minRow = row;
+            maxRow = row;
+            minCol = min(minCol, col);
+            maxCol = max(maxCol, col);
+        }
+    }
+    if (minRow < 0)
+        return;
+
+    rect.col = minCol;
+    rect.row = minRow;
+    rect.width = maxCol - minCol + 1;
+    rect.height = maxRow - minRow + 1;
+    submit(lcd, &rect, SSD1963_PRIO_NORMAL);
+}
+
+static int palette_set(struct ssd1963 *lcd, const struct ssd1963_palette *req)
+{
+    u16 *entries;
+    bool changed, indexed;
+    int i;
+
+    if (req->count == 0 || req->first + req->count > SSD1963_PALETTE_SIZE)
+        return -EINVAL;
+
+    entries = memdup_user(u64_to_user_ptr(req->data), req->count * 2);
+    if (IS_ERR(entries))
+        return PTR_ERR(entries);
+    for (i = 0; i < req->count; i++)
+        entries[i] = le16_to_cpu((__force __le16)entries[i]);
+
+    mutex_lock(&lcd->bus_lock);
+    changed = memcmp(&lcd->palette[req->first], entries, req->count * 2) != 0;
+    memcpy(&lcd->palette[req->first], entries, req->count * 2);
+    indexed = (lcd->format == SSD1963_FORMAT_INDEXED8);
+    mutex_unlock(&lcd->bus_lock);
+    kfree(entries);
+
+    if (changed && indexed && lcd->framebuffer)
+        palette_damage(lcd, req->first, req->count);
+
+    return 0;
+}
+
+static long ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct ssd1963_file *file = filp->private_data;
+    struct ssd1963 *lcd = file->lcd;
+    void __user *argp = (void __user *)arg;
+    struct ssd1963_cache_upload upload;
+    struct ssd1963_cache_show show;
+    struct ssd1963_sprite_register sprite;
+    struct ssd1963_sprite_move move;
+    struct ssd1963_submit damage;
+    struct ssd1963_submit_prio damage_prio;
+    struct ssd1963_stream stream;
+    struct ssd1963_palette palette;
+    struct ssd1963_compressed compressed;
+    struct ssd1963_geometry geometry = { .width = DISP_RES_HOR, .height = DISP_RES_VER };
+    u32 id;
+
+    switch (cmd)
+    {
+    case SSD1963_IOC_CACHE_UPLOAD:
+        if (copy_from_user(&upload, argp, sizeof(upload)))
+            return -EFAULT;
+        return img_cache_upload(lcd, &upload);
+    case SSD1963_IOC_CACHE_SHOW:
+        if (copy_from_user(&show, argp, sizeof(show)))
+            return -EFAULT;
+        return img_cache_request_show(lcd, &show);
+    case SSD1963_IOC_CACHE_DROP:
+        if (get_user(id, (u32 __user *)argp))
+            return -EFAULT;
+        return img_cache_drop(lcd, id);
+    case SSD1963_IOC_SPRITE_REGISTER:
+        if (copy_from_user(&sprite, argp, sizeof(sprite)))
+            return -EFAULT;
+        return sprite_register(lcd, &sprite);
+    case SSD1963_IOC_SPRITE_MOVE:
+        if (copy_from_user(&move, argp, sizeof(move)))
+            return -EFAULT;
+        return sprite_move(lcd, &move);
+    case SSD1963_IOC_SUBMIT:
+        if (copy_from_user(&damage, argp, sizeof(damage)))
+            return -EFAULT;
+        return submit(lcd, &damage, SSD1963_PRIO_NORMAL);
+    case SSD1963_IOC_SUBMIT_PRIO:
+        if (copy_from_user(&damage_prio, argp, sizeof(damage_prio)))
+            return -EFAULT;
+        return submit(lcd, &damage_prio.rect, damage_prio.priority);
+    case SSD1963_IOC_WAIT:
+        if (get_user(id, (u32 __user *)argp))
+            return -EFAULT;
+        return wait_done(lcd, id);
+    case SSD1963_IOC_STREAM:
+        if (copy_from_user(&stream, argp, sizeof(stream)))
+            return -EFAULT;
+        return stream_config(lcd, filp, &stream);
+    case SSD1963_IOC_FORMAT:
+        if (get_user(id, (u32 __user *)argp))
+            return -EFAULT;
+        return format_set(lcd, id);
+    case SSD1963_IOC_PALETTE:
+        if (copy_from_user(&palette, argp, sizeof(palette)))
+            return -EFAULT;
+        return palette_set(lcd, &palette);
+    case SSD1963_IOC_COMPRESSED:
+        if (copy_from_user(&compressed, argp, sizeof(compressed)))
+            return -EFAULT;
+        return compressed_queue(lcd, &compressed, u64_to_user_ptr(compressed.data));
+    case SSD1963_IOC_WRITE_MODE:
+        if (get_user(id, (u32 __user *)argp))
+            return -EFAULT;
+        if (id != SSD1963_WRITE_PIXELS && id != SSD1963_WRITE_COMPRESSED)
+            return -EINVAL;
+        WRITE_ONCE(file->write_mode, id);
+        return 0;
+    case SSD1963_IOC_GEOMETRY:
+        return copy_to_user(argp, &geometry, sizeof(geometry)) ? -EFAULT : 0;
+    default:
+        return -ENOTTY;
     }
 }
 
 static int release(struct inode *inode, struct file *filp)
 {
-    struct mmap_info *info = filp->private_data;
-    struct page *page;
+    struct ssd1963 *lcd = FILE_LCD(filp);
+
+    if (READ_ONCE(lcd->stream_owner) == filp)
+        stream_config(lcd, filp, &(struct ssd1963_stream){ .nbufs = 0 });
 
-	//pr_info("release (0x%lx)\n", (unsigned long)info->data);
-    framebuffer = NULL;
-	//info = filp->private_data;
-	//free_page((unsigned long)info->data);
-    page = virt_to_page(info->data);
-    put_page(page);
-    free_pages((unsigned long)info->data, PAGES_ORDER);
-	//kfree(info);
+    // The frame buffer stays allocated for the next client, see fbfree()
+    kfree(filp->private_data);
 	filp->private_data = NULL;
     
     return 0;
 }
 
+// proc entries take struct proc_ops since 5.6
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+static const struct proc_ops fops = {
+    .proc_mmap = mmap,
+    .proc_open = open,
+    .proc_release = release,
+    .proc_read = read,
+    .proc_write = write,
+    .proc_ioctl = ioctl,
+};
+#else
 static const struct file_operations fops = {
+    .owner = THIS_MODULE,
     .mmap = mmap,
     .open = open,
     .release = release,
     .read = read,
     .write = write,
+    .unlocked_ioctl = ioctl,
 };
+#endif
 
-static int fbinit(void)
+static int fbinit(struct ssd1963 *lcd)
 {
-    proc_create(filename, 0, NULL, &fops);
+    struct mmap_info *info = &lcd->info;
+    int i;
+
+    mutex_init(&lcd->fb_lock);
+    seqcount_init(&lcd->fb_seq);
+
+    // RGB332 until a client sets its own palette
+    for (i = 0; i < SSD1963_PALETTE_SIZE; i++)
+        lcd->palette[i] = ((((i >> 5) & 7) * 31 / 7) << 11) | ((((i >> 2) & 7) * 63 / 7) << 5) |
+                          ((i & 3) * 31 / 3);
+
+    info->order = PAGES_ORDER;
+    info->data = (char *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, info->order);
+    lcd->fb_stage = vmalloc(BUFFER_SIZE(info->order));
+    lcd->xfer = vmalloc(DISP_PIX_TOT * 2);
+    if (!info->data || !lcd->fb_stage || !lcd->xfer)
+    {
+        pr_err("Unable to allocate framebuffer!\n");
+        fbfree(lcd);
+        return -ENOMEM;
+    }
+    lcd->framebuffer = info->data;
+
+    // Without the prep buffer the update worker converts on its own
+    prep_init(lcd);
+    if (prep_wq)
+        lcd->prep_words = vmalloc(DISP_PIX_TOT * sizeof(u16));
+
+    if (!proc_create_data(lcd->name, 0, NULL, &fops, lcd))
+    {
+        fbfree(lcd);
+        return -ENOMEM;
+    }
     return 0;
 }
 
-static void fbexit(void)
+// Waits for the file operations in progress, the update worker may still
+// read the frame buffer until it is stopped
+static void fbexit(struct ssd1963 *lcd)
+{
+    remove_proc_entry(lcd->name, NULL);
+}
+
+// Once the update worker is stopped
+static void fbfree(struct ssd1963 *lcd)
 {
-    remove_proc_entry(filename, NULL);
+    if (lcd->info.data)
+        free_pages((unsigned long)lcd->info.data, lcd->info.order);
+    vfree(lcd->fb_stage);
+    vfree(lcd->xfer);
+    vfree(lcd->stream_ring);
+    vfree(lcd->prep_words);
+    lcd->info.data = NULL;
+    lcd->framebuffer = NULL;
+    lcd->fb_stage = NULL;
+    lcd->xfer = NULL;
+    lcd->stream_ring = NULL;
+    lcd->prep_words = NULL;
 }
 
@@ -0,0 +1,349 @@
+/*
+ * udas_fb_bench - workload benchmark for the SSD1963 framebuffer driver
+ *
+ * Drives /proc/udas_fb the way the UDAS applications do and reports the frame
+ * rate, submit-to-complete latency percentiles and client CPU time per frame.
+ * With -m the same workloads run against the driver's bus model (busMock
+ * module parameter), so results are comparable from release to release.
+ *
+ * Build: cc -O2 -Wall -o udas_fb_bench udas_fb_bench.c
+ * Usage: udas_fb_bench [-m] [-p panel] [-n frames] [-W width] [-H height] [workload...]
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "ssd1963_ioctl.h"
+
+#define FB_PATH         "/proc/udas_fb"        // panel 0, the others are udas_fb<n>
+#define PARAM_PATH      "/sys/module/ssd_1963/parameters/"
+#define WAIT_TIMEOUT_MS 2000
+#define IMAGE_ID_BASE   SSD1963_CACHE_ID_USER_MIN
+#define IMAGE_COUNT     4
+
+struct bench {
+    int fd;
+    int width;
+    int height;
+    uint16_t *fb;           // mmap of the driver buffer
+    size_t fbSize;
+    uint16_t *frame;        // scratch frame for write()
+    uint64_t *latency;      // per frame, ns
+};
+
+struct workload {
+    const char *name;
+    const char *desc;
+    int (*setup)(struct bench *b);
+    int (*frame)(struct bench *b, int n);   // returns 0 after submitting frame n
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ((uint64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ull +
+           ((uint64_t)ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ull;
+}
+
+static int param_write(const char *name, const char *value)
+{
+    char path[128];
+    FILE *f;
+
+    snprintf(path, sizeof(path), PARAM_PATH "%s", name);
+    f = fopen(path, "w");
+    if (!f)
+        return -errno;
+    fputs(value, f);
+    return fclose(f) ? -errno : 0;
+}
+
+static int param_read(const char *name, char *value, int size)
+{
+    char path[128];
+    FILE *f;
+    int ret;
+
+    snprintf(path, sizeof(path), PARAM_PATH "%s", name);
+    f = fopen(path, "r");
+    if (!f)
+        return -errno;
+    ret = fgets(value, size, f) ? 0 : -EIO;
+    fclose(f);
+    value[strcspn(value, "\n")] = '\0';
+    return ret;
+}
+
+// Resolution the driver reports for the panel, 480x272 on drivers without
+// SSD1963_IOC_GEOMETRY; sizes given on the command line (non-zero) are kept
+static void panel_geometry(int fd, int *width, int *height)
+{
+    struct ssd1963_geometry geometry = { .width = 480, .height = 272 };
+
+    ioctl(fd, SSD1963_IOC_GEOMETRY, &geometry);
+    if (*width <= 0)
+        *width = geometry.width;
+    if (*height <= 0)
+        *height = geometry.height;
+}
+
+static uint16_t rgb565(int r, int g, int b)
+{
+    return ((r & 0xf8) << 8) | ((g & 0xfc) << 3) | (b >> 3);
+}
+
+static void fill_rect(uint16_t *dst, int stride, int x, int y, int w, int h, uint16_t color)
+{
+    int row, col;
+
+    for (row = y; row < y + h; row++)
+        for (col = x; col < x + w; col++)
+            dst[(row * stride) + col] = color;
+}
+
+static int submit(struct bench *b, int x, int y, int w, int h)
+{
+    struct ssd1963_submit req = { .col = x, .row = y, .width = w, .height = h };
+
+    return ioctl(b->fd, SSD1963_IOC_SUBMIT, &req);
+}
+
+//----------------------------------------------------------------------------
+// Workloads
+
+// Full-frame video: a new frame is rendered in user memory and written
+static int video_frame(struct bench *b, int n)
+{
+    int row, col;
+
+    for (row = 0; row < b->height; row++)
+        for (col = 0; col < b->width; col++)
+            b->frame[(row * b->width) + col] = rgb565(col + n * 4, row + n * 2, n * 8);
+
+    if (pwrite(b->fd, b->frame, (size_t)b->width * b->height * 2, 0) < 0)
+        return -errno;
+    return submit(b, 0, 0, b->width, b->height);
+}
+
+// Small widget updates: a 64x32 button redrawn at moving positions
+static int widget_frame(struct bench *b, int n)
+{
+    int w = 64, h = 32;
+    int x = (n * 37) % (b->width - w);
+    int y = (n * 23) % (b->height - h);
+
+    fill_rect(b->fb, b->width, x, y, w, h, rgb565(n * 16, 128, 255 - n * 16));
+    fill_rect(b->fb, b->width, x + 4, y + 4, w - 8, h - 8, rgb565(255, 255, 255));
+    return submit(b, x, y, w, h);
+}
+
+// Text scrolling: a log area scrolls by one 16 pixel line per frame
+static int text_frame(struct bench *b, int n)
+{
+    int x = 8, y = 8, w = b->width - 16, h = b->height - 16, line = 16;
+    int row, col;
+
+    for (row = y; row < y + h - line; row++)
+        memmove(&b->fb[(row * b->width) + x], &b->fb[((row + line) * b->width) + x], w * 2);
+
+    // New line of "glyphs" at the bottom
+    fill_rect(b->fb, b->width, x, y + h - line, w, line, 0x0000);
+    for (col = 0; col < w / 12; col++)
+        if ((col * 7 + n) % 5)
+            fill_rect(b->fb, b->width, x + col * 12 + 1, y + h - line + 2, 9, line - 4, 0xffff);
+
+    return submit(b, x, y, w, h);
+}
+
+// Image switching: full-screen images uploaded once, then shown by ID
+static int switch_setup(struct bench *b)
+{
+    struct ssd1963_cache_upload up = { .width = b->width, .height = b->height };
+    int i;
+
+    for (i = 0; i < IMAGE_COUNT; i++)
+    {
+        fill_rect(b->frame, b->width, 0, 0, b->width, b->height, rgb565(i * 64, 255 - i * 64, 128));
+        up.id = IMAGE_ID_BASE + i;
+        up.data = (uintptr_t)b->frame;
+        if (ioctl(b->fd, SSD1963_IOC_CACHE_UPLOAD, &up))
+            return -errno;
+    }
+    return 0;
+}
+
+static int switch_frame(struct bench *b, int n)
+{
+    struct ssd1963_cache_show show = { .id = IMAGE_ID_BASE + (n % IMAGE_COUNT) };
+
+    return ioctl(b->fd, SSD1963_IOC_CACHE_SHOW, &show);
+}
+
+static const struct workload workloads[] = {
+    { "video",  "full-frame write() and submit",     NULL,         video_frame },
+    { "widget", "64x32 widget at moving positions",  NULL,         widget_frame },
+    { "text",   "log area scrolling one line",       NULL,         text_frame },
+    { "switch", "cached full-screen image switching", switch_setup, switch_frame },
+};
+
+//----------------------------------------------------------------------------
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static int run(struct bench *b, const struct workload *w, int frames)
+{
+    uint64_t start, cpu, submitted;
+    int n, ret;
+
+    if (w->setup && (ret = w->setup(b)))
+    {
+        fprintf(stderr, "%s: setup failed: %s\n", w->name, strerror(-ret));
+        return ret;
+    }
+    ioctl(b->fd, SSD1963_IOC_WAIT, &(uint32_t){ WAIT_TIMEOUT_MS });
+
+    start = now_ns();
+    cpu = cpu_ns();
+    for (n = 0; n < frames; n++)
+    {
+        submitted = now_ns();
+        ret = w->frame(b, n);
+        if (ret == 0)
+            ret = ioctl(b->fd, SSD1963_IOC_WAIT, &(uint32_t){ WAIT_TIMEOUT_MS });
+        if (ret)
+        {
+            fprintf(stderr, "%s: frame %d failed: %s\n", w->name, n, strerror(errno));
+            return -errno;
+        }
+        b->latency[n] = now_ns() - submitted;
+    }
+    start = now_ns() - start;
+    cpu = cpu_ns() - cpu;
+
+    qsort(b->latency, frames, sizeof(*b->latency), cmp_u64);
+    printf("%-7s %8.1f fps  latency p50 %7.2f p90 %7.2f p99 %7.2f max %7.2f ms  cpu %6.3f ms/frame\n",
+           w->name, frames * 1e9 / start,
+           b->latency[frames / 2] / 1e6, b->latency[(frames * 9) / 10] / 1e6,
+           b->latency[(frames * 99) / 100] / 1e6, b->latency[frames - 1] / 1e6,
+           cpu / 1e6 / frames);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    int i;
+
+    fprintf(stderr, "Usage: %s [-m] [-p panel] [-n frames] [-W width] [-H height] [workload...]\n"
+                    "  -m  run against the bus model instead of the panel\n"
+                    "  -p  panel to drive, default 0 (/proc/udas_fb)\n"
+                    "  -W/-H  override the panel resolution the driver reports\n"
+                    "Workloads:\n", prog);
+    for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+        fprintf(stderr, "  %-7s %s\n", workloads[i].name, workloads[i].desc);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench b = { 0 };
+    int frames = 200, mock = 0, panel = 0, ret = 0;
+    int opt, i, j;
+    char path[32];
+    char busMock[8];
+
+    while ((opt = getopt(argc, argv, "mp:n:W:H:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm': mock = 1; break;
+        case 'p': panel = atoi(optarg); break;
+        case 'n': frames = atoi(optarg); break;
+        case 'W': b.width = atoi(optarg); break;
+        case 'H': b.height = atoi(optarg); break;
+        default: usage(argv[0]); return 2;
+        }
+    }
+    if (frames <= 0)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (panel)
+        snprintf(path, sizeof(path), FB_PATH "%d", panel);
+    else
+        snprintf(path, sizeof(path), FB_PATH);
+    b.fd = open(path, O_RDWR);
+    if (b.fd < 0)
+    {
+        perror(path);
+        return 1;
+    }
+    panel_geometry(b.fd, &b.width, &b.height);
+    if (b.width <= 64 || b.height <= 32)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    b.fbSize = (size_t)b.width * b.height * 2;
+    b.fb = mmap(NULL, b.fbSize, PROT_READ | PROT_WRITE, MAP_SHARED, b.fd, 0);
+    b.frame = calloc(b.width * b.height, 2);
+    b.latency = calloc(frames, sizeof(*b.latency));
+    if (b.fb == MAP_FAILED || !b.frame || !b.latency)
+    {
+        perror("setup");
+        return 1;
+    }
+
+    // The previous busMock value is put back when done
+    if (mock && (param_read("busMock", busMock, sizeof(busMock)) || param_write("busMock", "1")))
+    {
+        fprintf(stderr, "Unable to select the bus model\n");
+        return 1;
+    }
+    printf("%dx%d, %d frames per workload, %s\n", b.width, b.height, frames,
+           mock ? "bus model" : "panel");
+
+    for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+    {
+        int selected = (optind == argc);
+
+        for (j = optind; j < argc; j++)
+            selected |= !strcmp(argv[j], workloads[i].name);
+        if (selected && run(&b, &workloads[i], frames))
+            ret = 1;
+    }
+
+    if (mock)
+        param_write("busMock", busMock);
+
+    munmap(b.fb, b.fbSize);
+    close(b.fd);
+    free(b.frame);
+    free(b.latency);
+    return ret;
+}
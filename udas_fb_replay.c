@@ -0,0 +1,391 @@
+/*
+ * udas_fb_replay - replay a captured SSD1963 update stream
+ *
+ * Feeds a log read from debugfs ssd1963/capture back through /proc/udas_fb,
+ * at the original pace or as fast as the driver accepts it, and reports how
+ * long the driver took to put the stream on the glass.
+ *
+ * Capture: echo 2 > /sys/module/ssd_1963/parameters/capture
+ *          cat /sys/kernel/debug/ssd1963/capture > updates.log
+ *
+ * Build: cc -O2 -Wall -o udas_fb_replay udas_fb_replay.c
+ * Usage: udas_fb_replay [-f] [-w] [-p panel] [-W width] [-H height] updates.log
+ *   -f   replay at maximum speed instead of the original timing
+ *   -w   wait for each request to complete before the next one
+ *   -p   replay the records of this panel (default 0, /proc/udas_fb); the
+ *        image module parameters only drive panel 0
+ *   -W/-H  override the panel resolution the driver reports
+ *
+ * Records captured without payload are replayed with a flat colour derived
+ * from their pixel hash, which keeps the bus traffic of the original stream.
+ * Stream frames reconfigure the streaming window when its geometry changes;
+ * compressed rectangles without payload are sent as a single-colour RLE.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "ssd1963_ioctl.h"
+
+#define FB_PATH         "/proc/udas_fb"        // panel 0, the others are udas_fb<n>
+#define PARAM_PATH      "/sys/module/ssd_1963/parameters/"
+#define WAIT_TIMEOUT_MS 2000
+
+struct replay {
+    int fd;
+    int width;
+    int height;
+    uint16_t *fb;           // mmap of the driver buffer
+    size_t fbSize;
+    uint8_t *payload;
+    size_t payloadSize;
+    uint16_t *rle;
+    size_t rleSize;
+    struct ssd1963_stream stream;   // streaming window set up by the replay, nbufs 0 if none
+    int wait;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+    struct timespec ts = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static int param_write_int(const char *name, int value)
+{
+    char path[128];
+    FILE *f;
+
+    snprintf(path, sizeof(path), PARAM_PATH "%s", name);
+    f = fopen(path, "w");
+    if (!f)
+        return -errno;
+    fprintf(f, "%d", value);
+    return fclose(f) ? -errno : 0;
+}
+
+// Resolution the driver reports for the panel, 480x272 on drivers without
+// SSD1963_IOC_GEOMETRY; sizes given on the command line (non-zero) are kept
+static void panel_geometry(int fd, int *width, int *height)
+{
+    struct ssd1963_geometry geometry = { .width = 480, .height = 272 };
+
+    ioctl(fd, SSD1963_IOC_GEOMETRY, &geometry);
+    if (*width <= 0)
+        *width = geometry.width;
+    if (*height <= 0)
+        *height = geometry.height;
+}
+
+// Pixels of a record: the captured payload, or a flat colour from the hash
+static const uint8_t *record_pixels(struct replay *r, const struct ssd1963_capture_record *rec)
+{
+    size_t size = (size_t)rec->width * rec->height * 2;
+    size_t i;
+
+    if (rec->length)
+        return r->payload;
+
+    if (size > r->payloadSize)
+    {
+        free(r->payload);
+        r->payload = malloc(size);
+        r->payloadSize = r->payload ? size : 0;
+        if (!r->payload)
+            return NULL;
+    }
+    for (i = 0; i < size; i += 2)
+    {
+        r->payload[i] = rec->hash & 0xff;
+        r->payload[i + 1] = (rec->hash >> 8) & 0xff;
+    }
+    return r->payload;
+}
+
+// Single-colour RLE of a compressed record captured without payload, runs of
+// little endian count, pixel
+static int record_rle(struct replay *r, const struct ssd1963_capture_record *rec, uint32_t *length)
+{
+    uint32_t left = (uint32_t)rec->width * rec->height;
+    size_t runs = (left + 0xfffe) / 0xffff;
+    size_t n = 0;
+    uint16_t count;
+
+    if (runs * 4 > r->rleSize)
+    {
+        free(r->rle);
+        r->rle = malloc(runs * 4);
+        r->rleSize = r->rle ? runs * 4 : 0;
+        if (!r->rle)
+            return -ENOMEM;
+    }
+    while (left)
+    {
+        count = left > 0xffff ? 0xffff : left;
+        r->rle[n++] = htole16(count);
+        r->rle[n++] = htole16(rec->hash & 0xffff);
+        left -= count;
+    }
+    *length = n * 2;
+    return 0;
+}
+
+// Stop the streaming window, write() takes frame buffer bytes again
+static int stream_stop(struct replay *r)
+{
+    struct ssd1963_stream stop = { 0 };
+
+    if (!r->stream.nbufs)
+        return 0;
+    r->stream.nbufs = 0;
+    return ioctl(r->fd, SSD1963_IOC_STREAM, &stop) ? -errno : 0;
+}
+
+static int replay_record(struct replay *r, const struct ssd1963_capture_record *rec)
+{
+    const uint8_t *pixels = NULL;
+    int row, ret;
+
+    if (rec->width && rec->height && rec->type != SSD1963_CAPTURE_SHOW &&
+        rec->type != SSD1963_CAPTURE_MOVE && rec->type != SSD1963_CAPTURE_IMAGE &&
+        rec->type != SSD1963_CAPTURE_COMPRESSED)
+    {
+        pixels = record_pixels(r, rec);
+        if (!pixels)
+            return -ENOMEM;
+    }
+
+    switch (rec->type)
+    {
+    case SSD1963_CAPTURE_SUBMIT:
+    {
+        struct ssd1963_submit_prio req = {
+            .rect = { .col = rec->col, .row = rec->row, .width = rec->width, .height = rec->height },
+            .priority = rec->arg,
+        };
+
+        if (rec->col < 0 || rec->row < 0 || rec->col + rec->width > r->width ||
+            rec->row + rec->height > r->height)
+            return -EINVAL;
+        for (row = 0; row < rec->height; row++)
+            memcpy(&r->fb[((rec->row + row) * r->width) + rec->col],
+                   pixels + ((size_t)row * rec->width * 2), rec->width * 2);
+        return ioctl(r->fd, SSD1963_IOC_SUBMIT_PRIO, &req) ? -errno : 0;
+    }
+    case SSD1963_CAPTURE_PACKED:
+        if ((size_t)rec->width * rec->height * 2 > r->fbSize)
+            return -EINVAL;
+        if ((ret = stream_stop(r)))
+            return ret;
+        if (pwrite(r->fd, pixels, (size_t)rec->width * rec->height * 2, 0) < 0)
+            return -errno;
+        param_write_int("startColumn", rec->col);
+        param_write_int("startRow", rec->row);
+        param_write_int("width", rec->width);
+        param_write_int("height", rec->height);
+        return param_write_int("image", 2);
+    case SSD1963_CAPTURE_IMAGE:
+        return param_write_int("image", rec->id);
+    case SSD1963_CAPTURE_UPLOAD:
+    {
+        struct ssd1963_cache_upload up = {
+            .id = rec->id, .width = rec->width, .height = rec->height, .data = (uintptr_t)pixels,
+        };
+
+        return ioctl(r->fd, SSD1963_IOC_CACHE_UPLOAD, &up) ? -errno : 0;
+    }
+    case SSD1963_CAPTURE_SHOW:
+    {
+        struct ssd1963_cache_show show = { .id = rec->id, .col = rec->col, .row = rec->row };
+
+        return ioctl(r->fd, SSD1963_IOC_CACHE_SHOW, &show) ? -errno : 0;
+    }
+    case SSD1963_CAPTURE_SPRITE:
+    {
+        struct ssd1963_sprite_register spr = {
+            .id = rec->id, .width = rec->width, .height = rec->height,
+            .colorkey = rec->arg, .data = (uintptr_t)pixels,
+        };
+
+        return ioctl(r->fd, SSD1963_IOC_SPRITE_REGISTER, &spr) ? -errno : 0;
+    }
+    case SSD1963_CAPTURE_MOVE:
+    {
+        struct ssd1963_sprite_move move = {
+            .id = rec->id, .col = rec->col, .row = rec->row, .visible = rec->arg,
+        };
+
+        return ioctl(r->fd, SSD1963_IOC_SPRITE_MOVE, &move) ? -errno : 0;
+    }
+    case SSD1963_CAPTURE_STREAM:
+    {
+        struct ssd1963_stream stream = {
+            .col = rec->col, .row = rec->row, .width = rec->width, .height = rec->height, .nbufs = rec->arg,
+        };
+
+        if (memcmp(&stream, &r->stream, sizeof(stream)))
+        {
+            if (ioctl(r->fd, SSD1963_IOC_STREAM, &stream))
+                return -errno;
+            r->stream = stream;
+        }
+        return write(r->fd, pixels, (size_t)rec->width * rec->height * 2) < 0 ? -errno : 0;
+    }
+    case SSD1963_CAPTURE_COMPRESSED:
+    {
+        struct ssd1963_compressed comp = {
+            .magic = SSD1963_COMPRESS_MAGIC, .method = rec->arg, .col = rec->col, .row = rec->row,
+            .width = rec->width, .height = rec->height, .length = rec->length,
+            .data = (uintptr_t)r->payload,
+        };
+
+        if (!rec->length)
+        {
+            if ((ret = record_rle(r, rec, &comp.length)))
+                return ret;
+            comp.method = SSD1963_COMPRESS_RLE;
+            comp.data = (uintptr_t)r->rle;
+        }
+        return ioctl(r->fd, SSD1963_IOC_COMPRESSED, &comp) ? -errno : 0;
+    }
+    default:
+        return -EINVAL;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct replay r = { 0 };
+    struct ssd1963_capture_record rec;
+    uint64_t start = 0, first = 0, elapsed;
+    unsigned long records = 0, failed = 0;
+    unsigned long skipped = 0;
+    int fast = 0, panel = 0, opt, ret;
+    char path[32];
+    FILE *log;
+
+    while ((opt = getopt(argc, argv, "fwp:W:H:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f': fast = 1; break;
+        case 'w': r.wait = 1; break;
+        case 'p': panel = atoi(optarg); break;
+        case 'W': r.width = atoi(optarg); break;
+        case 'H': r.height = atoi(optarg); break;
+        default: optind = argc; break;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "Usage: %s [-f] [-w] [-p panel] [-W width] [-H height] updates.log\n", argv[0]);
+        return 2;
+    }
+
+    log = fopen(argv[optind], "rb");
+    if (!log)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (panel)
+        snprintf(path, sizeof(path), FB_PATH "%d", panel);
+    else
+        snprintf(path, sizeof(path), FB_PATH);
+    r.fd = open(path, O_RDWR);
+    if (r.fd < 0)
+    {
+        perror(path);
+        return 1;
+    }
+    panel_geometry(r.fd, &r.width, &r.height);
+    r.fbSize = (size_t)r.width * r.height * 2;
+    r.fb = mmap(NULL, r.fbSize, PROT_READ | PROT_WRITE, MAP_SHARED, r.fd, 0);
+    if (r.fb == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+
+    while (fread(&rec, sizeof(rec), 1, log) == 1)
+    {
+        if (rec.magic != SSD1963_CAPTURE_MAGIC)
+        {
+            fprintf(stderr, "Bad record after %lu records\n", records);
+            break;
+        }
+        if (rec.length)
+        {
+            if (rec.length > r.payloadSize)
+            {
+                free(r.payload);
+                r.payload = malloc(rec.length);
+                r.payloadSize = r.payload ? rec.length : 0;
+            }
+            if (!r.payload || fread(r.payload, rec.length, 1, log) != 1)
+            {
+                fprintf(stderr, "Truncated payload after %lu records\n", records);
+                break;
+            }
+        }
+        if (rec.panel != panel)
+        {
+            skipped++;
+            continue;
+        }
+
+        if (!records)
+        {
+            start = now_ns();
+            first = rec.timestamp_ns;
+        }
+        else if (!fast)
+        {
+            sleep_until(start + (rec.timestamp_ns - first));
+        }
+
+        ret = replay_record(&r, &rec);
+        if (ret == 0 && r.wait)
+            ret = ioctl(r.fd, SSD1963_IOC_WAIT, &(uint32_t){ WAIT_TIMEOUT_MS }) ? -errno : 0;
+        if (ret)
+        {
+            failed++;
+            fprintf(stderr, "Record %lu (type %u): %s\n", records, rec.type, strerror(-ret));
+        }
+        records++;
+    }
+    ioctl(r.fd, SSD1963_IOC_WAIT, &(uint32_t){ WAIT_TIMEOUT_MS });
+    elapsed = records ? now_ns() - start : 0;
+    stream_stop(&r);
+
+    printf("%lu records (%lu failed, %lu of other panels) in %.3f s, %.1f records/s%s\n",
+           records, failed, skipped, elapsed / 1e9, elapsed ? records * 1e9 / elapsed : 0.0,
+           fast ? " (maximum speed)" : "");
+
+    munmap(r.fb, r.fbSize);
+    close(r.fd);
+    fclose(log);
+    free(r.payload);
+    free(r.rle);
+    return failed ? 1 : 0;
+}
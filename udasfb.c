@@ -0,0 +1,310 @@
+/*
+ * udasfb - client library for the SSD1963 framebuffer driver
+ *
+ * See udasfb.h.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "ssd1963_ioctl.h"
+#include "udasfb.h"
+
+#define FB_PATH         "/proc/udas_fb"        // panel 0, the others are udas_fb<n>
+#define PARAM_PATH      "/sys/module/ssd_1963/parameters/"
+#define LEGACY_POLL_NS  1000000
+
+struct udasfb {
+    int fd;
+    int panel;
+    int width;
+    int height;
+    uint16_t *fb;           // mmap of the driver buffer
+    size_t fbSize;
+    int legacy;             // driver without SSD1963_IOC_SUBMIT
+    int dirty;              // damage below is valid
+    int x0, y0, x1, y1;     // damage, inclusive
+};
+
+static int param_write_int(const char *name, int value)
+{
+    char path[128];
+    FILE *f;
+
+    snprintf(path, sizeof(path), PARAM_PATH "%s", name);
+    f = fopen(path, "w");
+    if (!f)
+        return -errno;
+    fprintf(f, "%d", value);
+    return fclose(f) ? -errno : 0;
+}
+
+static int param_read_int(const char *name, int *value)
+{
+    char path[128];
+    FILE *f;
+    int ret;
+
+    snprintf(path, sizeof(path), PARAM_PATH "%s", name);
+    f = fopen(path, "r");
+    if (!f)
+        return -errno;
+    ret = (fscanf(f, "%d", value) == 1) ? 0 : -EIO;
+    fclose(f);
+    return ret;
+}
+
+// Clip a rectangle to the frame, 0 if nothing is left
+static int clip(const struct udasfb *fb, int *x, int *y, int *width, int *height)
+{
+    int x1 = *x + *width, y1 = *y + *height;
+
+    if (*x < 0)
+        *x = 0;
+    if (*y < 0)
+        *y = 0;
+    if (x1 > fb->width)
+        x1 = fb->width;
+    if (y1 > fb->height)
+        y1 = fb->height;
+    *width = x1 - *x;
+    *height = y1 - *y;
+    return *width > 0 && *height > 0;
+}
+
+struct udasfb *udasfb_open(int panel, int width, int height)
+{
+    struct ssd1963_geometry geometry;
+    struct udasfb *fb;
+    char path[32];
+    int err;
+
+    fb = calloc(1, sizeof(*fb));
+    if (!fb)
+        return NULL;
+    fb->panel = panel;
+
+    if (panel)
+        snprintf(path, sizeof(path), FB_PATH "%d", panel);
+    else
+        snprintf(path, sizeof(path), FB_PATH);
+    fb->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fb->fd < 0)
+    {
+        err = errno;
+        free(fb);
+        errno = err;
+        return NULL;
+    }
+
+    // The panel reports its resolution, older drivers only drive 480x272
+    if (ioctl(fb->fd, SSD1963_IOC_GEOMETRY, &geometry) == 0)
+    {
+        fb->width = geometry.width;
+        fb->height = geometry.height;
+    }
+    else
+    {
+        fb->width = 480;
+        fb->height = 272;
+    }
+    if (width > 0)
+        fb->width = width;
+    if (height > 0)
+        fb->height = height;
+    fb->fbSize = (size_t)fb->width * fb->height * 2;
+
+    fb->fb = mmap(NULL, fb->fbSize, PROT_READ | PROT_WRITE, MAP_SHARED, fb->fd, 0);
+    if (fb->fb == MAP_FAILED)
+    {
+        err = errno;
+        close(fb->fd);
+        free(fb);
+        errno = err;
+        return NULL;
+    }
+    return fb;
+}
+
+void udasfb_close(struct udasfb *fb)
+{
+    if (!fb)
+        return;
+    munmap(fb->fb, fb->fbSize);
+    close(fb->fd);
+    free(fb);
+}
+
+int udasfb_width(const struct udasfb *fb)
+{
+    return fb->width;
+}
+
+int udasfb_height(const struct udasfb *fb)
+{
+    return fb->height;
+}
+
+uint16_t *udasfb_pixels(struct udasfb *fb)
+{
+    return fb->fb;
+}
+
+void udasfb_damage(struct udasfb *fb, int x, int y, int width, int height)
+{
+    if (!clip(fb, &x, &y, &width, &height))
+        return;
+
+    if (!fb->dirty)
+    {
+        fb->x0 = x;
+        fb->y0 = y;
+        fb->x1 = x + width - 1;
+        fb->y1 = y + height - 1;
+        fb->dirty = 1;
+        return;
+    }
+    // The driver draws one rectangle per request, keep the union
+    if (x < fb->x0)
+        fb->x0 = x;
+    if (y < fb->y0)
+        fb->y0 = y;
+    if (x + width - 1 > fb->x1)
+        fb->x1 = x + width - 1;
+    if (y + height - 1 > fb->y1)
+        fb->y1 = y + height - 1;
+}
+
+struct udasfb_view udasfb_view(struct udasfb *fb, int x, int y, int width, int height)
+{
+    struct udasfb_view v = { .stride = fb->width };
+
+    if (!clip(fb, &x, &y, &width, &height))
+        return v;
+
+    v.pixels = fb->fb + ((size_t)y * fb->width) + x;
+    v.x = x;
+    v.y = y;
+    v.width = width;
+    v.height = height;
+    udasfb_damage(fb, x, y, width, height);
+    return v;
+}
+
+void udasfb_fill(struct udasfb *fb, int x, int y, int width, int height, uint16_t color)
+{
+    struct udasfb_view v = udasfb_view(fb, x, y, width, height);
+    int row, col;
+
+    for (row = 0; row < v.height; row++)
+        for (col = 0; col < v.width; col++)
+            v.pixels[(row * v.stride) + col] = color;
+}
+
+void udasfb_blit(struct udasfb *fb, int x, int y, int width, int height,
+                 const uint16_t *src, int srcStride)
+{
+    struct udasfb_view v = udasfb_view(fb, x, y, width, height);
+    int row;
+
+    // Skip the source pixels clipped off the top and left
+    src += ((size_t)(v.y - y) * srcStride) + (v.x - x);
+    for (row = 0; row < v.height; row++)
+        memcpy(&v.pixels[row * v.stride], &src[(size_t)row * srcStride], v.width * 2);
+}
+
+// Older drivers: the buffer holds a packed full frame, shown with image 2
+static int legacy_submit(struct udasfb *fb)
+{
+    int ret;
+
+    if (fb->panel)
+        return -ENOTTY;     // the parameters only drive the first panel
+    if ((ret = param_write_int("startColumn", 0)) ||
+        (ret = param_write_int("startRow", 0)) ||
+        (ret = param_write_int("width", fb->width)) ||
+        (ret = param_write_int("height", fb->height)))
+        return ret;
+    return param_write_int("image", 2);
+}
+
+int udasfb_submit(struct udasfb *fb)
+{
+    return udasfb_submit_priority(fb, SSD1963_PRIO_NORMAL);
+}
+
+int udasfb_submit_priority(struct udasfb *fb, int priority)
+{
+    struct ssd1963_submit_prio req;
+    int ret;
+
+    if (!fb->dirty)
+        return 0;
+
+    if (!fb->legacy)
+    {
+        req.rect.col = fb->x0;
+        req.rect.row = fb->y0;
+        req.rect.width = fb->x1 - fb->x0 + 1;
+        req.rect.height = fb->y1 - fb->y0 + 1;
+        req.priority = priority;
+        // Drivers without priority classes only know SSD1963_IOC_SUBMIT
+        if (ioctl(fb->fd, SSD1963_IOC_SUBMIT_PRIO, &req) == 0 ||
+            (errno == ENOTTY && ioctl(fb->fd, SSD1963_IOC_SUBMIT, &req.rect) == 0))
+        {
+            fb->dirty = 0;
+            return 0;
+        }
+        if (errno != ENOTTY)
+            return -errno;
+        fb->legacy = 1;
+    }
+
+    ret = legacy_submit(fb);
+    if (ret == 0)
+        fb->dirty = 0;
+    return ret;
+}
+
+int udasfb_wait(struct udasfb *fb, unsigned int timeoutMs)
+{
+    struct timespec poll = { .tv_nsec = LEGACY_POLL_NS };
+    uint32_t timeout = timeoutMs;
+    unsigned int waited;
+    int image, ret;
+
+    if (!fb->legacy)
+    {
+        if (ioctl(fb->fd, SSD1963_IOC_WAIT, &timeout) == 0)
+            return 0;
+        if (errno != ENOTTY)
+            return -errno;
+        fb->legacy = 1;
+    }
+
+    // The driver clears the image parameter once the frame is drawn
+    for (waited = 0; ; waited++)
+    {
+        ret = param_read_int("image", &image);
+        if (ret || image == 0)
+            return ret;
+        if (waited * (LEGACY_POLL_NS / 1000000) >= timeoutMs)
+            return -ETIMEDOUT;
+        nanosleep(&poll, NULL);
+    }
+}
+
+int udasfb_flush(struct udasfb *fb, unsigned int timeoutMs)
+{
+    int ret = udasfb_submit(fb);
+
+    return ret ? ret : udasfb_wait(fb, timeoutMs);
+}
@@ -0,0 +1,83 @@
+/*
+ * udasfb - client library for the SSD1963 framebuffer driver
+ *
+ * Maps /proc/udas_fb once, hands out RGB565 views of the frame, records the
+ * damage the application draws and submits it with SSD1963_IOC_SUBMIT. On
+ * drivers without the submit ioctls the whole frame is sent through the
+ * image module parameters instead.
+ *
+ * Build: cc -O2 -Wall -c udasfb.c
+ *
+ *   struct udasfb *fb = udasfb_open(0, 0, 0);
+ *   struct udasfb_view v = udasfb_view(fb, 10, 10, 64, 32);
+ *   for (y = 0; y < v.height; y++)
+ *       for (x = 0; x < v.width; x++)
+ *           v.pixels[(y * v.stride) + x] = udasfb_rgb565(255, 0, 0);
+ *   udasfb_flush(fb, 1000);
+ *   udasfb_close(fb);
+ *
+ */
+
+#ifndef UDASFB_H
+#define UDASFB_H
+
+#include <stdint.h>
+
+struct udasfb;
+
+// Rectangle of the frame, pixels[(y * stride) + x] for 0 <= x < width and
+// 0 <= y < height. Empty (width or height 0) if the rectangle is off-screen.
+struct udasfb_view {
+    uint16_t *pixels;
+    int stride;         // pixels per frame row
+    int x;              // position of the view in the frame
+    int y;
+    int width;
+    int height;
+};
+
+static inline uint16_t udasfb_rgb565(int r, int g, int b)
+{
+    return ((r & 0xf8) << 8) | ((g & 0xfc) << 3) | ((b & 0xff) >> 3);
+}
+
+// Open a panel (0 for /proc/udas_fb, n for /proc/udas_fb<n>) of the given
+// resolution, 0 takes the resolution the driver reports (480x272 on drivers
+// without SSD1963_IOC_GEOMETRY). Returns NULL with errno set on failure.
+struct udasfb *udasfb_open(int panel, int width, int height);
+void udasfb_close(struct udasfb *fb);
+
+int udasfb_width(const struct udasfb *fb);
+int udasfb_height(const struct udasfb *fb);
+
+// Whole frame, not marked damaged
+uint16_t *udasfb_pixels(struct udasfb *fb);
+
+// Clipped view of a rectangle, marked damaged: the caller is expected to draw
+// into it before the next submit
+struct udasfb_view udasfb_view(struct udasfb *fb, int x, int y, int width, int height);
+
+// Mark a rectangle drawn through udasfb_pixels() as damaged
+void udasfb_damage(struct udasfb *fb, int x, int y, int width, int height);
+
+// Drawing helpers, the rectangle is clipped and marked damaged
+void udasfb_fill(struct udasfb *fb, int x, int y, int width, int height, uint16_t color);
+void udasfb_blit(struct udasfb *fb, int x, int y, int width, int height,
+                 const uint16_t *src, int srcStride);
+
+// Send the damage accumulated since the last submit, 0 or -errno. Nothing is
+// sent if nothing was drawn.
+int udasfb_submit(struct udasfb *fb);
+
+// udasfb_submit() with a priority class, SSD1963_PRIO_HIGH for alarms and
+// SSD1963_PRIO_LOW for large background redraws that may be interrupted
+int udasfb_submit_priority(struct udasfb *fb, int priority);
+
+// Wait until everything submitted is on the glass, 0, -ETIMEDOUT or -errno.
+// The frame must not be drawn over a submitted rectangle before this returns.
+int udasfb_wait(struct udasfb *fb, unsigned int timeoutMs);
+
+// udasfb_submit() then udasfb_wait()
+int udasfb_flush(struct udasfb *fb, unsigned int timeoutMs);
+
+#endif /* UDASFB_H */